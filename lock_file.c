@@ -1,23 +1,167 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/file.h>
 #include <signal.h>
 #include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/sysmacros.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ipc.h>
+#include <sys/sem.h>
+#include <stddef.h>
+
+/*
+ * USDT probes for perf/bpftrace, e.g. `bpftrace -e 'usdt:./flock:flock:lock__acquired { ... }'`
+ * Each probe has a semaphore that the tracer raises while attached, and
+ * its arguments are only worked out then - otherwise a probe costs one
+ * load and branch. They compile to nothing at all where sys/sdt.h is
+ * not installed.
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define HAVE_SDT 1
+#endif
+#endif
+
+#ifdef HAVE_SDT
+#define PROBE_SEMAPHORE(name)       unsigned short flock_##name##_semaphore __attribute__((section(".probes")))
+#define PROBE_ENABLED(name)         __builtin_expect(flock_##name##_semaphore, 0)
+#define PROBE4(name, a, b, c, d)    do { if (PROBE_ENABLED(name)) DTRACE_PROBE4(flock, name, a, b, c, d); } while (0)
+#define PROBE5(name, a, b, c, d, e) do { if (PROBE_ENABLED(name)) DTRACE_PROBE5(flock, name, a, b, c, d, e); } while (0)
+
+PROBE_SEMAPHORE(lock__request);
+PROBE_SEMAPHORE(lock__acquired);
+PROBE_SEMAPHORE(lock__failed);
+PROBE_SEMAPHORE(holder__exit);
+PROBE_SEMAPHORE(timeout);
+PROBE_SEMAPHORE(request__done);
+PROBE_SEMAPHORE(unlock__requested);
+#else
+#define PROBE4(name, a, b, c, d)    do { } while (0)
+#define PROBE5(name, a, b, c, d, e) do { } while (0)
+#endif
 
 #define PARENT_TO  SIGUSR1
 #define CHILD_OK   SIGUSR1
 #define CHILD_FAIL SIGUSR2
 #define UNLOCK     SIGUSR2
+#define ADVANCE    SIGRTMIN
+#define RENEW      (SIGRTMIN + 1)
+#define CONTENDED  (SIGRTMIN + 2)
+
+#define EXIT_REJECTED 75
 
 #define MAX_PID_LEN 10
+#define MAX_OWNER_LEN 128
+
+#define ABSTRACT_PREFIX       "flock:"
+
+#define BACKOFF_MIN_US        1000
+#define BACKOFF_MAX_US        100000
+
+#define DOTLOCK_BREAK_AGE     10
+
+#define SYSV_NSEMS            4
+#define SYSV_MAX_COUNT        32767
+#define SYSV_INIT_TRIES       1000
+
+#define STATS_SHM_NAME    "/flock-stats-%u"
+#define STATS_MAX_LOCKS   1024
+#define STATS_PATH_LEN    256
+#define STATS_SUB_BITS    3
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_MAX_EXP     39
+#define STATS_BUCKETS     ((STATS_MAX_EXP - STATS_SUB_BITS + 2) * STATS_SUB_BUCKETS)
+#define STATS_SPIN_LIMIT  100000
+#define STATS_DEADLINES   16
+#define STATS_WAITERS     64
+#define STATS_REAP_SPINS  1024
+
+#define DEADLINE_POLL_NS  10000000
+
+#define TRACE_ENV         "FLOCK_TRACE_DIR"
+#define TRACE_MAGIC       0x664c6b54
+#define TRACE_CAPACITY    1024
+#define TRACE_PATH_LEN    200
+
+#define PROC_LOCKS        "/proc/locks"
+
+#define LOCKDEP_ENV       "FLOCK_LOCKDEP"
+#define LOCKDEP_SITE_LEN  256
+#define LOCKDEP_MAX_EDGES 4096
+#define LOCKDEP_MAX_HELD  2
+
+#define RANGE_ESCALATE    128
+
+#define TREE_MAX_HOLDERS  256
+#define TREE_ENTRY_LEN    48
+
+#define TOP_INTERVAL_US   100000
+#define TOP_MAX_ROWS      40
 
 enum l_type {
 	FLOCK = 0,
 	FCNTL,
-	LOCKF
+	LOCKF,
+	ABSTRACT,
+	SYSV,
+	DOTLOCK,
+	TREE
+};
+
+const char *type_names[] = {
+	[FLOCK]    = "flock",
+	[FCNTL]    = "fcntl",
+	[LOCKF]    = "lockf",
+	[ABSTRACT] = "abstract",
+	[SYSV]     = "sysv",
+	[DOTLOCK]  = "dotlock",
+	[TREE]     = "tree"
+};
+
+/*
+ * A byte range of a file, for fcntl locks
+ * A length of 0 runs to the end of the file, however far it grows.
+ */
+struct lock_range {
+	off_t start;
+	off_t len;
+};
+
+/*
+ * Multi-granularity modes for tree locks
+ */
+enum tree_mode {
+	TREE_IS = 0,
+	TREE_IX,
+	TREE_S,
+	TREE_SIX,
+	TREE_X
+};
+
+const char *tree_mode_names[] = {
+	[TREE_IS]  = "IS",
+	[TREE_IX]  = "IX",
+	[TREE_S]   = "S",
+	[TREE_SIX] = "SIX",
+	[TREE_X]   = "X"
 };
 
 struct lock_request {
@@ -26,103 +170,3810 @@ struct lock_request {
 	enum l_type type;
 	int         no_block;
 	int         timeout;
+	int         async;
+	char      **chain;
+	int         chain_len;
+	int         chain_pos;
+	int         ttl;
+	time_t      expires;
+	int         heartbeat_fd;
+	int         expire_sig;
+	int         contention_fd;
+	uint64_t    deadline_ns;
+	int         max_waiters;
+	int         count;
+	int         semid;
+	int         stale;
+	int         dotlock_link;
+	int         sharded;
+	const char *tree_dir;
+	enum tree_mode mode;
+	int         script_pid;
+	struct lock_range *ranges;
+	int         n_ranges;
+	int         escalate;
+	const char *callsite;
+	unsigned long long token;
+	struct lock_stats *stats;
+	uint64_t    requested_ns;
+	uint64_t    acquired_ns;
+};
+
+/*
+ * Per-lock statistics, shared between all flock processes
+ * Times are in nanoseconds, histograms in microseconds.
+ */
+struct lock_stats {
+	uint64_t key;
+	uint64_t last_used_ns;
+	char     path[STATS_PATH_LEN];
+	uint32_t seq;
+	int32_t  writer;
+	int32_t  holder;
+	int32_t  waiters[STATS_WAITERS];
+	uint64_t held_since_ns;
+	struct {
+		int32_t  pid;
+		uint64_t deadline_ns;
+	}        deadlines[STATS_DEADLINES];
+	uint64_t acquires;
+	uint64_t releases;
+	uint64_t busy;
+	uint64_t timeouts;
+	uint64_t failures;
+	uint64_t stale;
+	uint64_t wait_ns;
+	uint64_t hold_ns;
+	uint64_t recent_hold_ns;
+	uint32_t wait_hist[STATS_BUCKETS];
+	uint32_t hold_hist[STATS_BUCKETS];
+};
+
+struct stats_table {
+	struct lock_stats locks[STATS_MAX_LOCKS];
+};
+
+/*
+ * Lock events recorded to the per-process trace rings
+ */
+enum trace_type {
+	TRACE_REQUEST = 0,
+	TRACE_ACQUIRE,
+	TRACE_FAIL,
+	TRACE_TIMEOUT,
+	TRACE_RELEASE,
+	TRACE_UNLOCK
+};
+
+struct trace_event {
+	uint64_t ts_ns;
+	int32_t  pid;
+	int32_t  session;
+	uint32_t type;
+	char     path[TRACE_PATH_LEN];
+};
+
+struct trace_ring {
+	uint32_t           magic;
+	uint32_t           capacity;
+	uint64_t           head;
+	struct trace_event events[TRACE_CAPACITY];
+};
+
+/*
+ * A lock listed in /proc/locks against one of the files asked about
+ */
+struct proc_lock {
+	int  pid;
+	int  waiter;
+	int  write;
+	char type[8];
+};
+
+struct lock_target {
+	const char       *path;
+	int               exists;
+	dev_t             dev;
+	ino_t             ino;
+	int               n_holders;
+	int               n_waiters;
+	struct proc_lock *locks;
+	int               n_locks;
+	int               max_locks;
+};
+
+/*
+ * Parsed contents of a lock file's owner record
+ */
+struct owner_record {
+	int                pid;
+	long long          expires;
+	unsigned long long token;
 };
 
 int child = 0;
 
-int lock_descriptor(struct lock_request *req) {
-	int retval = 1;
-	
-	switch (req->type) {
-		case LOCKF:
-			errno = 0;
-			if (lockf(req->fd, (req->no_block) ? F_TLOCK : F_LOCK, 0) == -1) {
-				printf("Failed to lock file (fd = %i): %s\n", req->fd, strerror(errno));
-				retval = 0;
+/*
+ * The request this process is working on, for the signal handlers
+ */
+struct lock_request *active_req = NULL;
+
+uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Work out the absolute path used to identify a lock
+ * The file itself may not exist yet, so resolve its directory instead.
+ */
+void stats_path(const char *filename, char *path) {
+	char        dir[PATH_MAX],
+	           *slash;
+	const char *base = filename;
+
+	snprintf(dir, sizeof(dir), "%s", filename);
+	if ((slash = strrchr(dir, '/')) != NULL) {
+		base = filename + (slash - dir) + 1;
+		if (slash == dir)
+			slash[1] = '\0';
+		else
+			*slash = '\0';
+	}
+	else {
+		strcpy(dir, ".");
+	}
+
+	if (realpath(dir, path) == NULL) {
+		snprintf(path, PATH_MAX, "%s", filename);
+		return;
+	}
+	if (path[strlen(path) - 1] != '/')
+		strncat(path, "/", PATH_MAX - strlen(path) - 1);
+	strncat(path, base, PATH_MAX - strlen(path) - 1);
+}
+
+/*
+ * FNV-1a hash of a lock path
+ * 0 marks an empty slot so is never returned.
+ */
+uint64_t stats_hash(const char *path) {
+	uint64_t hash = 14695981039346656037ULL;
+
+	while (*path) {
+		hash ^= (unsigned char)*path++;
+		hash *= 1099511628211ULL;
+	}
+	return hash ? hash : 1;
+}
+
+/*
+ * PID of the process that asked the holder to move along
+ * its chain of lock files, set from the ADVANCE handler
+ */
+volatile sig_atomic_t advance_pid = 0;
+
+/*
+ * Set from the RENEW handler when someone renews our lease
+ */
+volatile sig_atomic_t renew_requested = 0;
+
+/*
+ * Set from the CONTENDED handler when a waiter starts queueing behind us
+ */
+volatile sig_atomic_t contention = 0;
+
+/*
+ * Function to read the owner PID from an open lock file
+ * Returns 0 if the file does not contain a valid PID
+ */
+int read_pid(int fd) {
+	int   pid = 0;
+	char  pid_str[MAX_PID_LEN+1] = {0},
+	     *end;
+
+	if (pread(fd, pid_str, MAX_PID_LEN, 0) > 0) {
+		pid = (int)strtol(pid_str, &end, 10);
+		if (*end != '\0' && *end != '\n')
+			pid = 0;
+	}
+	return pid;
+}
+
+/*
+ * Abstract socket functions
+ *
+ * The abstract backend holds a lock by binding a Unix socket in the
+ * abstract namespace, named after the lock. Binding is atomic, the
+ * kernel frees the name when the holder dies, and no file is ever
+ * created. The holder also listens, so that anyone connecting can
+ * find out its PID with SO_PEERCRED.
+ */
+
+/*
+ * Work out the abstract socket address for a lock
+ * Long paths are replaced by their hash to fit in sun_path.
+ */
+socklen_t abstract_address(const char *filename, struct sockaddr_un *addr) {
+	char path[PATH_MAX];
+	int  len;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	stats_path(filename, path);
+	len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, ABSTRACT_PREFIX "%s", path);
+	if (len >= (int)sizeof(addr->sun_path) - 1)
+		len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, ABSTRACT_PREFIX "%016llx",
+		               (unsigned long long)stats_hash(path));
+
+	return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+/*
+ * Function to take an abstract socket lock
+ * Retries with exponential backoff while the name is in use,
+ * unless told not to block.
+ */
+int abstract_lock(struct lock_request *req) {
+	struct sockaddr_un addr;
+	socklen_t          len   = abstract_address(req->filename, &addr);
+	useconds_t         delay = BACKOFF_MIN_US;
+
+	errno = 0;
+	if ((req->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return 0;
+
+	while (bind(req->fd, (struct sockaddr *)&addr, len) < 0) {
+		if (errno != EADDRINUSE || req->no_block) {
+			close(req->fd);
+			req->fd = -1;
+			return 0;
+		}
+		usleep(delay);
+		if ((delay *= 2) > BACKOFF_MAX_US)
+			delay = BACKOFF_MAX_US;
+	}
+
+	listen(req->fd, SOMAXCONN);
+	return 1;
+}
+
+/*
+ * Function to find the PID of the process holding an abstract lock
+ * Returns 0 if nobody holds it, -1 on error
+ */
+int abstract_holder(const char *filename) {
+	struct sockaddr_un addr;
+	struct ucred       cred;
+	socklen_t          len = abstract_address(filename, &addr),
+	                   cred_len = sizeof(cred);
+	int                fd,
+	                   pid = -1;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *)&addr, len) < 0)
+		pid = (errno == ECONNREFUSED) ? 0 : -1;
+	else if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == 0)
+		pid = cred.pid;
+
+	close(fd);
+	return pid;
+}
+
+/*
+ * SysV semaphore functions
+ *
+ * The sysv backend maps a lock to a SysV semaphore set. Semaphore 0
+ * is the number of holders still allowed in, so --count N gives a
+ * counting lock, and semaphore 1 remembers N. Holders take one with
+ * SEM_UNDO and the kernel gives it back when they die.
+ *
+ * The key is 31 bits of a hash of the lock's absolute path rather
+ * than ftok(), so no file is needed. Semaphores 2 and 3 hold another
+ * 30 bits of the hash, so two paths whose keys collide are told apart
+ * and the second is refused rather than sharing the first's lock. *
+ * The kernel only remembers the last process to take a count, so each
+ * holder also binds one of N holder slots: abstract sockets named after
+ * the key, freed by the kernel when the holder dies like the count is.
+ * Connecting to the slots finds every holder, and the holder answers
+ * with the PID of its script so that --unlock can pick its own.
+ */
+struct sysv_id {
+	key_t key;
+	short check[2];
+};
+
+void sysv_id(const char *filename, struct sysv_id *id) {
+	char     path[PATH_MAX];
+	uint64_t hash;
+
+	stats_path(filename, path);
+	hash = stats_hash(path);
+	id->key      = (key_t)(hash & 0x7fffffff);
+	id->check[0] = (short)((hash >> 31) & 0x7fff);
+	id->check[1] = (short)((hash >> 46) & 0x7fff);
+}
+
+/*
+ * Function to find or create the semaphore set for a lock
+ * Whoever creates it sets it up with a single semop, which sets
+ * sem_otime - everyone else waits for that so they never see it
+ * before it has been given its count. If the creator dies first the
+ * set is removed and made again.
+ * A count of 0 accepts whatever count the set already has.
+ */
+int sysv_open(const char *filename, int count, int create) {
+	struct sembuf   init[SYSV_NSEMS];
+	struct semid_ds ds;
+	struct sysv_id  id;
+	union {
+		int              val;
+		struct semid_ds *buf;
+	}               arg;
+	int             semid,
+	                have,
+	                tries,
+	                attempt;
+
+	sysv_id(filename, &id);
+	init[0] = (struct sembuf){0, count ? count : 1, 0};
+	init[1] = (struct sembuf){1, count ? count : 1, 0};
+	init[2] = (struct sembuf){2, id.check[0], 0};
+	init[3] = (struct sembuf){3, id.check[1], 0};
+
+	for (attempt = 0; attempt < 2; attempt++) {
+		if (create && (semid = semget(id.key, SYSV_NSEMS, IPC_CREAT | IPC_EXCL | 0666)) >= 0) {
+			if (semop(semid, init, SYSV_NSEMS) == 0)
+				return semid;
+			if (errno == EIDRM || errno == EINVAL)
+				continue;
+			return -1;
+		}
+		if ((create && errno != EEXIST) || (semid = semget(id.key, SYSV_NSEMS, 0)) < 0) {
+			if (errno == ENOENT && create)
+				continue;
+			return -1;
+		}
+
+		arg.buf = &ds;
+		ds.sem_otime = 0;
+		for (tries = 0; tries < SYSV_INIT_TRIES; tries++) {
+			if (semctl(semid, 0, IPC_STAT, arg) < 0)
+				break;
+			if (ds.sem_otime != 0)
+				break;
+			usleep(BACKOFF_MIN_US);
+		}
+		if (tries == SYSV_INIT_TRIES) {
+			/*
+			 * The creator died before setting it up
+			 */
+			semctl(semid, 0, IPC_RMID);
+			continue;
+		}
+		if (ds.sem_otime == 0) {
+			if (errno == EIDRM || errno == EINVAL)
+				continue;
+			return -1;
+		}
+
+		if (semctl(semid, 2, GETVAL) != id.check[0] || semctl(semid, 3, GETVAL) != id.check[1]) {
+			printf("Semaphore key for %s is in use by another lock\n", filename);
+			errno = EEXIST;
+			return -1;
+		}
+		if (count && (have = semctl(semid, 1, GETVAL)) != count) {
+			printf("Semaphore for %s already has count %i\n", filename, have);
+			errno = EINVAL;
+			return -1;
+		}
+		return semid;
+	}
+	errno = ETIMEDOUT;
+	return -1;
+}
+
+/*
+ * Work out the abstract socket address of a semaphore lock's holder slot
+ */
+socklen_t sysv_slot_address(const char *filename, int slot, struct sockaddr_un *addr) {
+	struct sysv_id id;
+	int            len;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	sysv_id(filename, &id);
+	len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, ABSTRACT_PREFIX "sysv:%08x.%04hx%04hx:%i",
+	               (unsigned)id.key, id.check[0], id.check[1], slot);
+	return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+/*
+ * Function to bind a free holder slot once we have a count
+ * A holder that has just died gives its count back before its socket
+ * is closed, so every slot can briefly be in use - wait for it.
+ */
+int sysv_claim(struct lock_request *req) {
+	struct sockaddr_un addr;
+	socklen_t          len;
+	int                count,
+	                   slot,
+	                   tries;
+
+	if ((count = semctl(req->semid, 1, GETVAL)) <= 0 ||
+	    (req->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return 0;
+
+	for (tries = 0; tries < SYSV_INIT_TRIES; tries++) {
+		for (slot = 0; slot < count; slot++) {
+			len = sysv_slot_address(req->filename, slot, &addr);
+			if (bind(req->fd, (struct sockaddr *)&addr, len) == 0) {
+				listen(req->fd, SOMAXCONN);
+				return 1;
 			}
+			if (errno != EADDRINUSE)
+				break;
+		}
+		if (slot < count)
 			break;
-		case FLOCK:
-			if (flock(req->fd, (req->no_block) ? LOCK_EX | LOCK_NB : LOCK_EX) == -1) {
-				printf("Failed to lock file (fd = %i): %s\n", req->fd, strerror(errno));
-				retval = 0;
+		usleep(BACKOFF_MIN_US);
+	}
+
+	close(req->fd);
+	req->fd = -1;
+	return 0;
+}
+
+/*
+ * Function to give back our count of a semaphore lock
+ * If that leaves every count free, take them all at once so nobody can
+ * get in while the set is removed - otherwise semaphores would pile up
+ * in the kernel, one for every path ever locked.
+ */
+void sysv_release(struct lock_request *req) {
+	struct sembuf up  = {0, 1, SEM_UNDO},
+	              all = {0, 0, SEM_UNDO | IPC_NOWAIT};
+	int           count;
+
+	if (req->semid < 0)
+		return;
+	if (semop(req->semid, &up, 1) == 0 && (count = semctl(req->semid, 1, GETVAL)) > 0) {
+		all.sem_op = -count;
+		if (semop(req->semid, &all, 1) == 0)
+			semctl(req->semid, 0, IPC_RMID);
+	}
+	req->semid = -1;
+}
+
+/*
+ * Function to take one count of a semaphore lock
+ * A single semtimedop replaces open + lock + PID write. The set can
+ * be removed by its last holder between open and semop, in which case
+ * we start again on a new one.
+ */
+int sysv_lock(struct lock_request *req) {
+	struct sembuf   op = {0, -1, SEM_UNDO};
+	struct timespec ts = {req->timeout, 0};
+
+	if (req->no_block)
+		op.sem_flg |= IPC_NOWAIT;
+	do {
+		if ((req->semid = sysv_open(req->filename, req->count, 1)) < 0)
+			return 0;
+		if (semtimedop(req->semid, &op, 1, (req->timeout > 0) ? &ts : NULL) == 0) {
+			if (sysv_claim(req))
+				return 1;
+			sysv_release(req);
+			return 0;
+		}
+	} while (errno == EIDRM);
+
+	req->semid = -1;
+	return 0;
+}
+
+/*
+ * Function to find a process holding a count of a semaphore lock
+ * Returns want if it is one of the holders, otherwise one started by
+ * the calling script, otherwise any. Returns 0 if nobody holds it, -1
+ * on error.
+ */
+int sysv_holder(const char *filename, int want) {
+	struct sockaddr_un addr;
+	struct ucred       cred;
+	struct timeval     tv = {0, 100000};
+	socklen_t          len,
+	                   cred_len;
+	int                semid,
+	                   count,
+	                   held,
+	                   found = 0,
+	                   first = 0,
+	                   script,
+	                   fd,
+	                   slot;
+
+	if ((semid = sysv_open(filename, 0, 0)) < 0)
+		return (errno == ENOENT || errno == EIDRM) ? 0 : -1;
+	if ((count = semctl(semid, 1, GETVAL)) < 0 || (held = count - semctl(semid, 0, GETVAL)) <= 0)
+		return 0;
+
+	for (slot = 0; slot < count && found < held; slot++) {
+		if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+			return -1;
+		len      = sysv_slot_address(filename, slot, &addr);
+		cred_len = sizeof(cred);
+		if (connect(fd, (struct sockaddr *)&addr, len) < 0 ||
+		    getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0) {
+			close(fd);
+			continue;
+		}
+		found++;
+		if (cred.pid == want) {
+			close(fd);
+			return want;
+		}
+
+		/*
+		 * A holder busy moving along a chain may not answer at once
+		 */
+		script = 0;
+		if (!want) {
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+			if (read(fd, &script, sizeof(script)) == sizeof(script) && script == getppid()) {
+				close(fd);
+				return cred.pid;
 			}
-			break;
-		case FCNTL:
-			break;
+		}
+		close(fd);
+		if (!first)
+			first = cred.pid;
+	}
+	return first;
+}
+
+/*
+ * Range lock functions
+ *
+ * The fcntl backend locks the whole file, or with --range only the given
+ * byte ranges of it. The kernel keeps a list of every range each
+ * process holds on a file and walks it on every lock and unlock, so the
+ * holder keeps that list short: ranges that touch or overlap are merged
+ * into one, and past --escalate ranges the holder takes one whole-file
+ * lock instead. Ranged locks leave the file's contents alone, so they
+ * have no owner record - the holder is found with F_GETLK instead.
+ */
+int compare_ranges(const void *a, const void *b) {
+	const struct lock_range *x = a,
+	                        *y = b;
+
+	return (x->start > y->start) - (x->start < y->start);
+}
+
+/*
+ * Function to sort ranges and merge any that touch or overlap, then
+ * give up on ranges altogether if there are still too many
+ */
+void coalesce_ranges(struct lock_request *req) {
+	struct lock_range *r = req->ranges;
+	int                i,
+	                   n = 0;
+
+	if (req->n_ranges == 0)
+		return;
+
+	qsort(r, req->n_ranges, sizeof(*r), compare_ranges);
+	for (i = 1; i < req->n_ranges; i++) {
+		if (r[n].len != 0 && r[i].start > r[n].start + r[n].len) {
+			r[++n] = r[i];
+			continue;
+		}
+		if (r[n].len == 0)
+			continue;
+		if (r[i].len == 0)
+			r[n].len = 0;
+		else if (r[i].start + r[i].len > r[n].start + r[n].len)
+			r[n].len = r[i].start + r[i].len - r[n].start;
+	}
+	req->n_ranges = n + 1;
+
+	if (req->n_ranges > req->escalate) {
+		printf("Escalating %i ranges of %s to a whole-file lock\n", req->n_ranges, req->filename);
+		r[0].start    = 0;
+		r[0].len      = 0;
+		req->n_ranges = 1;
+	}
+}
+
+int fcntl_lock(struct lock_request *req) {
+	struct lock_range  whole  = {0, 0},
+	                  *ranges = req->ranges;
+	struct flock       fl     = {0};
+	int                n      = req->n_ranges,
+	                   i;
+
+	if (n == 0) {
+		ranges = &whole;
+		n      = 1;
+	}
+
+	/*
+	 * Always in file order, so that two holders can't deadlock
+	 */
+	for (i = 0; i < n; i++) {
+		fl.l_type   = F_WRLCK;
+		fl.l_whence = SEEK_SET;
+		fl.l_start  = ranges[i].start;
+		fl.l_len    = ranges[i].len;
+		if (fcntl(req->fd, req->no_block ? F_SETLK : F_SETLKW, &fl) < 0)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Function to find the PID holding the first range of a ranged lock
+ * Returns 0 if nobody holds it
+ */
+int range_holder(int fd, struct lock_request *req) {
+	struct flock fl = {0};
+
+	fl.l_type   = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start  = req->ranges[0].start;
+	fl.l_len    = req->ranges[0].len;
+	if (fcntl(fd, F_GETLK, &fl) < 0 || fl.l_type == F_UNLCK)
+		return 0;
+	return fl.l_pid;
+}
+
+/*
+ * Dotlock functions
+ *
+ * The dotlock backend holds a lock on FILE by creating FILE.lock, for
+ * shared and network filesystems where flock and lockf are missing or
+ * can't be trusted. The lock file records the holder's PID, host and
+ * creation time so that a lock left behind by a dead holder can be
+ * recognised and broken. FILE itself still gets the usual owner record,
+ * so unlock, advance and fencing tokens work as for the other backends.
+ */
+void dotlock_path(const char *filename, char *path) {
+	snprintf(path, PATH_MAX, "%s.lock", filename);
+}
+
+/*
+ * Function to create a dotlock atomically
+ * Uses O_EXCL, or with --link links a uniquely named temporary file
+ * into place for old NFS clients where O_EXCL isn't atomic. A lost
+ * reply can make link() fail when it worked, so the link count of the
+ * temporary file decides.
+ * Returns 1 if created, 0 if the lock exists, -1 on error
+ */
+int dotlock_create(struct lock_request *req, const char *path) {
+	char        record[MAX_OWNER_LEN+1] = {0},
+	            host[HOST_NAME_MAX+1]   = {0},
+	            tmp[PATH_MAX+HOST_NAME_MAX+16];
+	struct stat st;
+	int         fd,
+	            len,
+	            ret;
+
+	gethostname(host, HOST_NAME_MAX);
+	len = snprintf(record, MAX_OWNER_LEN, "%i\nhost=%s\ncreated=%lld\n", getpid(), host, (long long)time(NULL));
+
+	if (!req->dotlock_link) {
+		if ((fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644)) < 0)
+			return (errno == EEXIST) ? 0 : -1;
+		write(fd, record, len);
+		close(fd);
+		return 1;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.%s.%i", path, host, getpid());
+	if ((fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0)
+		return -1;
+	write(fd, record, len);
+	close(fd);
+
+	errno = 0;
+	link(tmp, path);
+	if (stat(tmp, &st) == 0 && st.st_nlink == 2)
+		ret = 1;
+	else
+		ret = (errno == 0 || errno == EEXIST) ? 0 : -1;
+	unlink(tmp);
+	return ret;
+}
+
+/*
+ * Function to read a dotlock and decide whether it is stale
+ * A lock is stale if its holder was on this host and has died, or if it
+ * is older than max_age seconds (0 to never age locks out). A lock still
+ * being written has no PID yet and is only aged out.
+ * Returns 1 if stale, 0 if live, -1 on error (errno ENOENT if no lock)
+ */
+int dotlock_stale(const char *path, int max_age, int *pid, ino_t *ino) {
+	char        record[MAX_OWNER_LEN+1] = {0},
+	            host[HOST_NAME_MAX+1]   = {0},
+	           *line,
+	           *next;
+	const char *owner_host = NULL;
+	time_t      created;
+	struct stat st;
+	int         fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || read(fd, record, MAX_OWNER_LEN) < 0) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	*ino    = st.st_ino;
+	*pid    = (int)strtol(record, NULL, 10);
+	created = st.st_mtime;
+	for (line = record; line && *line; line = next) {
+		if ((next = strchr(line, '\n')) != NULL)
+			*next++ = '\0';
+		if (strncmp(line, "host=", 5) == 0)
+			owner_host = line + 5;
+		else if (strncmp(line, "created=", 8) == 0)
+			created = strtoll(line + 8, NULL, 10);
+	}
+
+	gethostname(host, HOST_NAME_MAX);
+	if (*pid > 0 && owner_host && strcmp(owner_host, host) == 0 &&
+	    kill(*pid, 0) < 0 && errno == ESRCH)
+		return 1;
+	if (max_age > 0 && time(NULL) - created > max_age)
+		return 1;
+	return 0;
+}
+
+/*
+ * Function to remove a dotlock, but only if it is stale or, with mine
+ * set, our own
+ * Checking the lock and then unlinking its name would remove a fresh
+ * lock created in between, even if it were compared by inode - inodes
+ * are reused at once. So a lock that looks removable is first renamed
+ * to a name only we use, where nobody can replace it, and checked again
+ * there. One that was replaced in between is linked back into place -
+ * if a third lock got in while it was gone, its holder finds out from
+ * dotlock_mine() and gives up.
+ * Returns 1 if removed, 0 if not, with the holder's PID in *pid
+ */
+int dotlock_remove(const char *path, int max_age, int mine, int *pid) {
+	char  grave[PATH_MAX+HOST_NAME_MAX+32],
+	      host[HOST_NAME_MAX+1] = {0};
+	ino_t ino;
+	int   stale;
+
+	*pid = 0;
+	stale = dotlock_stale(path, max_age, pid, &ino);
+	if (stale < 0 || !(mine ? (*pid == getpid()) : (stale == 1)))
+		return 0;
+
+	gethostname(host, HOST_NAME_MAX);
+	snprintf(grave, sizeof(grave), "%s.%s.%i.stale", path, host, getpid());
+	if (rename(path, grave) < 0)
+		return 0;
+
+	stale = dotlock_stale(grave, max_age, pid, &ino);
+	if (mine ? (*pid == getpid()) : (stale == 1)) {
+		unlink(grave);
+		return 1;
+	}
+
+	/*
+	 * Not ours to remove - only a new lock created in the moment it
+	 * was gone can stop it going back
+	 */
+	if (link(grave, path) < 0)
+		printf("Failed to restore lock %s held by %i: %s\n", path, *pid, strerror(errno));
+	unlink(grave);
+	return 0;
+}
+
+/*
+ * Function to break a stale dotlock
+ * Breakers take turns under FILE.lock.break, itself a dotlock, so that
+ * one of them can't break the fresh lock another has just taken. A
+ * breaker that died holding it is broken in turn once it is dead or
+ * DOTLOCK_BREAK_AGE seconds old.
+ * Returns 1 if broken, 0 if not (for now)
+ */
+int dotlock_break(struct lock_request *req, const char *path, int *pid) {
+	char  brk[PATH_MAX+8];
+	ino_t ino;
+	int   ret,
+	      brk_pid;
+
+	snprintf(brk, sizeof(brk), "%s.break", path);
+	if ((ret = dotlock_create(req, brk)) <= 0) {
+		if (ret == 0 && dotlock_stale(brk, DOTLOCK_BREAK_AGE, &brk_pid, &ino) == 1)
+			dotlock_remove(brk, DOTLOCK_BREAK_AGE, 0, &brk_pid);
+		return 0;
+	}
+
+	ret = dotlock_stale(path, req->stale, pid, &ino) == 1 &&
+	      dotlock_remove(path, req->stale, 0, pid);
+	dotlock_remove(brk, 0, 1, &brk_pid);
+	return ret;
+}
+
+/*
+ * Function to take a dotlock
+ * Breaks stale locks, and otherwise retries with jittered exponential
+ * backoff so that waiters on different clients don't retry in step.
+ */
+int dotlock_lock(struct lock_request *req) {
+	char        path[PATH_MAX];
+	useconds_t  delay = BACKOFF_MIN_US;
+	unsigned    seed  = getpid() ^ (unsigned)now_ns();
+	ino_t       ino;
+	int         ret,
+	            pid;
+
+	dotlock_path(req->filename, path);
+	while ((ret = dotlock_create(req, path)) == 0) {
+		if (dotlock_stale(path, req->stale, &pid, &ino) == 1 && dotlock_break(req, path, &pid)) {
+			printf("Broke stale lock %s held by %i\n", path, pid);
+			continue;
+		}
+		if (req->no_block) {
+			errno = EWOULDBLOCK;
+			return 0;
+		}
+		usleep(delay / 2 + rand_r(&seed) % (delay / 2 + 1));
+		if ((delay *= 2) > BACKOFF_MAX_US)
+			delay = BACKOFF_MAX_US;
+	}
+	return ret > 0;
+}
+
+/*
+ * Function to remove our dotlock on a file
+ * Leaves it alone if it isn't ours any more, e.g. because it aged out
+ * and was broken while we held it.
+ */
+void dotlock_release(const char *filename) {
+	char path[PATH_MAX];
+	int  pid;
+
+	dotlock_path(filename, path);
+	dotlock_remove(path, 0, 1, &pid);
+}
+
+/*
+ * Function to check that our dotlock is still ours
+ * A breaker may have it parked under another name for a moment, so
+ * look again before deciding it has gone.
+ */
+int dotlock_mine(struct lock_request *req) {
+	char  path[PATH_MAX];
+	int   pid,
+	      tries;
+	ino_t ino;
+
+	dotlock_path(req->filename, path);
+	for (tries = 0; tries < 3; tries++) {
+		if (dotlock_stale(path, 0, &pid, &ino) >= 0 && pid == getpid())
+			return 1;
+		usleep(BACKOFF_MAX_US);
+	}
+	return 0;
+}
+
+/*
+ * Function to find the PID holding a dotlock
+ * Returns 0 if nobody holds it, -1 on error
+ */
+int dotlock_holder(struct lock_request *req) {
+	char  path[PATH_MAX];
+	int   pid,
+	      tries,
+	      ret;
+	ino_t ino;
+
+	dotlock_path(req->filename, path);
+	for (tries = 0; tries < 10; tries++) {
+		if ((ret = dotlock_stale(path, req->stale, &pid, &ino)) < 0)
+			return (errno == ENOENT) ? 0 : -1;
+		if (ret == 1)
+			return 0;
+		if (pid > 0)
+			return pid;
+		/*
+		 * Still being written
+		 */
+		usleep(BACKOFF_MIN_US);
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+/*
+ * Namespace functions
+ *
+ * --namespace DIR --key NAME locks DIR/ab/cd/<hash of NAME> rather than
+ * a file named after the key, so that millions of keys don't end up in
+ * one huge directory. Two levels of 256 directories keep each one
+ * small. They are only created when a lock file is first made in them.
+ */
+void namespace_path(const char *dir, const char *key, char *path) {
+	uint64_t hash = stats_hash(key);
+
+	snprintf(path, PATH_MAX, "%s/%02x/%02x/%016llx", dir,
+	         (unsigned)(hash >> 56), (unsigned)(hash >> 48) & 0xff, (unsigned long long)hash);
+}
+
+/*
+ * Function to create the directories above a lock file
+ * Losing a race with someone else creating the same one is fine.
+ */
+int make_parents(const char *filename) {
+	char  path[PATH_MAX],
+	     *slash;
+
+	snprintf(path, sizeof(path), "%s", filename);
+	for (slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		if (mkdir(path, 0755) < 0 && errno != EEXIST)
+			return 0;
+		*slash = '/';
+	}
+	return 1;
+}
+
+/*
+ * Tree lock functions
+ *
+ * --tree DIR locks a path in a hierarchy with one of the multi-granularity
+ * modes IS, IX, S, SIX or X, after taking the matching intention mode
+ * (IS to read, IX to write) on each of its ancestors. Locking a/b/c for
+ * X takes IX on the root, a and a/b, so a writer on a/b/d can run at the
+ * same time while an S or X lock on a still excludes them both.
+ *
+ * Kernel locks only come in shared and exclusive, which can't express
+ * these modes, so each node is a file listing its holders and their
+ * modes, flocked only while it is read or updated. Waiters poll with
+ * backoff, and entries left by holders that died are dropped the next
+ * time the node is read. Nodes live in DIR under the same hashed layout
+ * as --namespace, and are always taken root first so that tree locks
+ * can't deadlock against each other.
+ */
+const int tree_compatible[5][5] = {
+	/*            IS IX  S SIX  X */
+	[TREE_IS]  = { 1, 1, 1, 1,  0 },
+	[TREE_IX]  = { 1, 1, 0, 0,  0 },
+	[TREE_S]   = { 1, 0, 1, 0,  0 },
+	[TREE_SIX] = { 1, 0, 0, 0,  0 },
+	[TREE_X]   = { 0, 0, 0, 0,  0 }
+};
+
+struct tree_entry {
+	int            pid;
+	int            script_pid;
+	enum tree_mode mode;
+	int            held;
+};
+
+int parse_tree_mode(const char *arg, enum tree_mode *mode) {
+	int i;
+
+	for (i = TREE_IS; i <= TREE_X; i++) {
+		if (strcasecmp(arg, tree_mode_names[i]) == 0) {
+			*mode = i;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Function to work out the node file for the first depth components of
+ * a tree path. Returns the number of components in the path.
+ */
+int tree_node(const char *dir, const char *path, int depth, char *node) {
+	char        prefix[PATH_MAX] = {0};
+	const char *p = path,
+	           *end;
+	size_t      len,
+	            used = 0;
+	int         n    = 0;
+
+	while (*p) {
+		while (*p == '/')
+			p++;
+		if (!*p)
+			break;
+		end = strchrnul(p, '/');
+		len = end - p;
+		if (!(len == 1 && *p == '.')) {
+			if (n++ < depth && used + len + 1 < sizeof(prefix)) {
+				if (used)
+					prefix[used++] = '/';
+				memcpy(prefix + used, p, len);
+				used += len;
+			}
+		}
+		p = end;
+	}
+
+	if (node)
+		namespace_path(dir, prefix, node);
+	return n;
+}
+
+/*
+ * Function to read the holders of a node, dropping any that have died
+ */
+int tree_read(int fd, struct tree_entry *entries) {
+	char    buf[TREE_MAX_HOLDERS * TREE_ENTRY_LEN + 1] = {0},
+	        mode[8],
+	        kind[8],
+	       *line,
+	       *next;
+	int     n = 0;
+
+	if (pread(fd, buf, sizeof(buf) - 1, 0) <= 0)
+		return 0;
+
+	for (line = buf; line && *line && n < TREE_MAX_HOLDERS; line = next) {
+		if ((next = strchr(line, '\n')) != NULL)
+			*next++ = '\0';
+		if (sscanf(line, "%i %i %7s %7s", &entries[n].pid, &entries[n].script_pid, mode, kind) != 4 ||
+		    !parse_tree_mode(mode, &entries[n].mode))
+			continue;
+		if (kill(entries[n].pid, 0) < 0 && errno == ESRCH)
+			continue;
+		entries[n].held = (strcmp(kind, "held") == 0);
+		n++;
+	}
+	return n;
+}
+
+void tree_write(int fd, struct tree_entry *entries, int n) {
+	char buf[TREE_MAX_HOLDERS * TREE_ENTRY_LEN + 1];
+	int  i,
+	     len = 0;
+
+	for (i = 0; i < n; i++)
+		len += snprintf(buf + len, sizeof(buf) - len, "%i %i %s %s\n", entries[i].pid, entries[i].script_pid,
+		                tree_mode_names[entries[i].mode], entries[i].held ? "held" : "intent");
+	ftruncate(fd, 0);
+	pwrite(fd, buf, len, 0);
+}
+
+/*
+ * Function to open a node and take its latch
+ * Reopens the node if --gc removed it while we were waiting.
+ */
+int tree_latch(const char *node, int create) {
+	struct stat st;
+	int         fd;
+
+	for (;;) {
+		if ((fd = open(node, create ? O_CREAT | O_RDWR : O_RDWR, 0700)) < 0 && errno == ENOENT &&
+		    create && make_parents(node))
+			fd = open(node, O_CREAT | O_RDWR, 0700);
+		if (fd < 0)
+			return -1;
+		if (flock(fd, LOCK_EX) < 0) {
+			close(fd);
+			return -1;
+		}
+		if (fstat(fd, &st) == 0 && st.st_nlink > 0)
+			return fd;
+		close(fd);
+	}
+}
+
+/*
+ * Function to take one node of a tree lock in the given mode
+ */
+int tree_take(struct lock_request *req, const char *node, enum tree_mode mode, int held) {
+	struct tree_entry entries[TREE_MAX_HOLDERS];
+	useconds_t        delay = BACKOFF_MIN_US;
+	unsigned          seed  = getpid() ^ (unsigned)now_ns();
+	int               fd,
+	                  n,
+	                  i;
+
+	for (;;) {
+		if ((fd = tree_latch(node, 1)) < 0)
+			return 0;
+
+		n = tree_read(fd, entries);
+		for (i = 0; i < n && tree_compatible[mode][entries[i].mode]; i++)
+			;
+		if (i == n && n < TREE_MAX_HOLDERS) {
+			entries[n].pid        = getpid();
+			entries[n].script_pid = req->script_pid;
+			entries[n].mode       = mode;
+			entries[n].held       = held;
+			tree_write(fd, entries, n + 1);
+			close(fd);
+			return 1;
+		}
+		close(fd);
+
+		if (req->no_block) {
+			errno = EWOULDBLOCK;
+			return 0;
+		}
+		usleep(delay / 2 + rand_r(&seed) % (delay / 2 + 1));
+		if ((delay *= 2) > BACKOFF_MAX_US)
+			delay = BACKOFF_MAX_US;
+	}
+}
+
+/*
+ * Function to remove our entry from one node
+ */
+void tree_drop(const char *node) {
+	struct tree_entry entries[TREE_MAX_HOLDERS];
+	int               fd,
+	                  n,
+	                  i,
+	                  j;
+
+	if ((fd = tree_latch(node, 0)) < 0)
+		return;
+
+	n = tree_read(fd, entries);
+	for (i = j = 0; i < n; i++) {
+		if (entries[i].pid != getpid())
+			entries[j++] = entries[i];
+	}
+	tree_write(fd, entries, j);
+	close(fd);
+}
+
+/*
+ * Function to release a tree lock, leaf first
+ * Also used to back out of a lock that was only partly taken.
+ */
+void tree_release(struct lock_request *req) {
+	char node[PATH_MAX];
+	int  depth = tree_node(req->tree_dir, req->filename, 0, NULL);
+
+	for (; depth >= 0; depth--) {
+		tree_node(req->tree_dir, req->filename, depth, node);
+		tree_drop(node);
+	}
+}
+
+/*
+ * Function to take a tree lock, root first
+ */
+int tree_lock(struct lock_request *req) {
+	enum tree_mode intent = (req->mode == TREE_IS || req->mode == TREE_S) ? TREE_IS : TREE_IX;
+	char           node[PATH_MAX];
+	int            leaf = tree_node(req->tree_dir, req->filename, 0, NULL),
+	               depth;
+
+	for (depth = 0; depth <= leaf; depth++) {
+		tree_node(req->tree_dir, req->filename, depth, node);
+		if (!tree_take(req, node, (depth == leaf) ? req->mode : intent, depth == leaf)) {
+			tree_release(req);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Function to find the PID holding a tree path
+ * Prefers a holder started by the calling script, so that --unlock
+ * finds our own lock when others hold the same path in shared modes.
+ * Returns 0 if nobody holds it, -1 on error
+ */
+int tree_holder(struct lock_request *req) {
+	struct tree_entry entries[TREE_MAX_HOLDERS];
+	char              node[PATH_MAX];
+	int               fd,
+	                  n,
+	                  i,
+	                  pid = 0;
+
+	tree_node(req->tree_dir, req->filename, INT_MAX, node);
+	if ((fd = open(node, O_RDONLY)) < 0)
+		return (errno == ENOENT) ? 0 : -1;
+	n = tree_read(fd, entries);
+	close(fd);
+
+	for (i = 0; i < n; i++) {
+		if (!entries[i].held)
+			continue;
+		if (entries[i].script_pid == getppid())
+			return entries[i].pid;
+		if (!pid)
+			pid = entries[i].pid;
+	}
+	return pid;
+}
+
+/*
+ * Backend selection
+ *
+ * -T auto picks a backend from the type of filesystem the lock lives
+ * on. Local filesystems get flock, the cheapest. NFS and SMB get lockf,
+ * which the client hands on to the server's lock manager - flock there
+ * is only emulated with a whole-file fcntl lock, and isn't on older
+ * kernels. FUSE filesystems often implement locks only locally or not
+ * at all, so they get dotlock. Anything unrecognised gets flock, as if
+ * no type had been given.
+ */
+struct fs_backend {
+	uint32_t    magic;
+	const char *name;
+	enum l_type type;
+};
+
+const struct fs_backend fs_backends[] = {
+	{0x01021994, "tmpfs",   FLOCK},
+	{0x858458f6, "ramfs",   FLOCK},
+	{0x0000ef53, "ext4",    FLOCK},
+	{0x58465342, "xfs",     FLOCK},
+	{0x9123683e, "btrfs",   FLOCK},
+	{0x2fc12fc1, "zfs",     FLOCK},
+	{0x794c7630, "overlay", FLOCK},
+	{0x00006969, "nfs",     LOCKF},
+	{0xff534d42, "cifs",    LOCKF},
+	{0xfe534d42, "smb2",    LOCKF},
+	{0x65735546, "fuse",    DOTLOCK}
+};
+
+/*
+ * Function to choose a backend for a lock
+ * Looks at the file's filesystem, or that of its nearest directory
+ * that exists, and sets *fs_name to the name of the filesystem.
+ */
+enum l_type auto_type(struct lock_request *req, const char **fs_name) {
+	static char   unknown[32];
+	char          dir[PATH_MAX],
+	             *slash;
+	struct statfs sfs;
+	size_t        i;
+	int           ret;
+
+	if (req->fd)
+		ret = fstatfs(req->fd, &sfs);
+	else {
+		snprintf(dir, sizeof(dir), "%s", req->filename);
+		while ((ret = statfs(dir, &sfs)) < 0 && errno == ENOENT && strcmp(dir, ".") != 0) {
+			if ((slash = strrchr(dir, '/')) == NULL)
+				strcpy(dir, ".");
+			else if (slash == dir)
+				dir[1] = '\0';
+			else
+				*slash = '\0';
+		}
+	}
+
+	if (ret < 0) {
+		*fs_name = "unknown filesystem";
+		return FLOCK;
+	}
+	for (i = 0; i < sizeof(fs_backends) / sizeof(fs_backends[0]); i++) {
+		if ((uint32_t)sfs.f_type == fs_backends[i].magic) {
+			*fs_name = fs_backends[i].name;
+			return fs_backends[i].type;
+		}
+	}
+	snprintf(unknown, sizeof(unknown), "filesystem 0x%x", (unsigned)sfs.f_type);
+	*fs_name = unknown;
+	return FLOCK;
+}
+
+/*
+ * Check whether a lock type keeps its state somewhere other than the
+ * file it is named after
+ */
+int fileless(struct lock_request *req) {
+	return req->type == ABSTRACT || req->type == SYSV || req->type == TREE;
+}
+
+/*
+ * Function to find the PID holding a lock with no file, by asking the
+ * socket, semaphore or tree. Returns 0 if nobody holds it, -1 on error.
+ */
+int fileless_holder(struct lock_request *req) {
+	switch (req->type) {
+		case SYSV:
+			return sysv_holder(req->filename, 0);
+		case TREE:
+			return tree_holder(req);
+		default:
+			return abstract_holder(req->filename);
+	}
+}
+
+/*
+ * Function to find the PID of the process holding a lock
+ * Returns 0 and prints the reason if it cannot be found
+ */
+int read_holder(struct lock_request *req) {
+	const char *filename = req->filename;
+	int         fd,
+	            pid;
+
+	if (fileless(req)) {
+		if ((pid = fileless_holder(req)) < 0) {
+			printf("Failed to contact holder of %s: %s\n", filename, strerror(errno));
+			return 0;
+		}
+		if (pid == 0)
+			printf("Lock %s is not held\n", filename);
+		return pid;
+	}
+
+	errno = 0;
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		printf("Failed to open file %s: %s\n", filename, strerror(errno));
+		return 0;
+	}
+	if (req->n_ranges) {
+		if ((pid = range_holder(fd, req)) == 0)
+			printf("Ranges of file %s are not locked\n", filename);
+	}
+	else if ((pid = read_pid(fd)) == 0)
+		printf("Failed to read pid from file %s\n", filename);
+	close(fd);
+	return pid;
+}
+
+/*
+ * Function to read the whole owner record from an open lock file
+ * Fields missing from the record are left as 0.
+ * Reads with pread so a holder can use its own locked descriptor -
+ * opening and closing the file again would drop its lockf locks.
+ */
+void read_owner_record(int fd, struct owner_record *rec) {
+	char    record[MAX_OWNER_LEN+1] = {0},
+	       *line,
+	       *next;
+	ssize_t len;
+
+	memset(rec, 0, sizeof(*rec));
+	if ((len = pread(fd, record, MAX_OWNER_LEN, 0)) <= 0)
+		return;
+
+	rec->pid = read_pid(fd);
+	for (line = record; line && *line; line = next) {
+		if ((next = strchr(line, '\n')) != NULL)
+			*next++ = '\0';
+		if (strncmp(line, "expires=", 8) == 0)
+			rec->expires = strtoll(line + 8, NULL, 10);
+		else if (strncmp(line, "token=", 6) == 0)
+			rec->token = strtoull(line + 6, NULL, 10);
+	}
+}
+
+/*
+ * Function to write the owner record to a locked file
+ * The PID always comes first so that read_pid() can find it,
+ * followed by one key=value line per optional field.
+ */
+void write_owner_record(struct lock_request *req) {
+	char record[MAX_OWNER_LEN+1] = {0};
+	int  len;
+
+	len = snprintf(record, MAX_OWNER_LEN, "%i\n", getpid());
+	if (req->ttl)
+		len += snprintf(record + len, MAX_OWNER_LEN - len, "expires=%lld\n", (long long)req->expires);
+	len += snprintf(record + len, MAX_OWNER_LEN - len, "token=%llu\n", req->token);
+
+	ftruncate(req->fd, 0);
+	pwrite(req->fd, record, len, 0);
+}
+
+int lock_descriptor(struct lock_request *req) {
+	int retval = 1,
+	    err    = 0;
+	
+	PROBE4(lock__request, req->filename, type_names[req->type], 0, req->fd);
+	switch (req->type) {
+		case LOCKF:
+			errno = 0;
+			if (lockf(req->fd, (req->no_block) ? F_TLOCK : F_LOCK, 0) == -1) {
+				err = errno;
+				printf("Failed to lock file (fd = %i): %s\n", req->fd, strerror(err));
+				retval = 0;
+			}
+			break;
+		case FLOCK:
+			if (flock(req->fd, (req->no_block) ? LOCK_EX | LOCK_NB : LOCK_EX) == -1) {
+				err = errno;
+				printf("Failed to lock file (fd = %i): %s\n", req->fd, strerror(err));
+				retval = 0;
+			}
+			break;
+		case FCNTL:
+			errno = 0;
+			if (!fcntl_lock(req)) {
+				err = errno;
+				printf("Failed to lock file (fd = %i): %s\n", req->fd, strerror(err));
+				retval = 0;
+			}
+			break;
+		case ABSTRACT:
+			if (!abstract_lock(req)) {
+				err = errno;
+				printf("Failed to lock %s: %s\n", req->filename, strerror(err));
+				retval = 0;
+			}
+			break;
+		case SYSV:
+			if (!sysv_lock(req)) {
+				err = errno;
+				printf("Failed to lock %s: %s\n", req->filename, strerror(err));
+				retval = 0;
+			}
+			break;
+		case DOTLOCK:
+			if (!dotlock_lock(req)) {
+				err = errno;
+				printf("Failed to lock %s: %s\n", req->filename, strerror(err));
+				retval = 0;
+			}
+			break;
+		case TREE:
+			if (!tree_lock(req)) {
+				err = errno;
+				printf("Failed to lock %s: %s\n", req->filename, strerror(err));
+				retval = 0;
+			}
+			break;
+	}
+	
+	/*
+	 * The failure message may have changed errno - callers still need it
+	 */
+	if (retval)
+		PROBE4(lock__acquired, req->filename, type_names[req->type], now_ns() - req->requested_ns, req->fd);
+	else {
+		PROBE5(lock__failed, req->filename, type_names[req->type], now_ns() - req->requested_ns, req->fd, err);
+		errno = err;
+	}
+	return retval;
+}
+
+/*
+ * Try once to lock a descriptor without blocking or complaining
+ */
+int try_lock(struct lock_request *req) {
+	int ret;
+
+	switch (req->type) {
+		case LOCKF:
+			return lockf(req->fd, F_TLOCK, 0) == 0;
+		case FLOCK:
+			return flock(req->fd, LOCK_EX | LOCK_NB) == 0;
+		case ABSTRACT:
+			req->no_block = 1;
+			ret = abstract_lock(req);
+			req->no_block = 0;
+			return ret;
+		case SYSV:
+			req->no_block = 1;
+			ret = sysv_lock(req);
+			req->no_block = 0;
+			return ret;
+		case FCNTL:
+			req->no_block = 1;
+			ret = fcntl_lock(req);
+			req->no_block = 0;
+			return ret;
+		case DOTLOCK:
+			req->no_block = 1;
+			ret = dotlock_lock(req);
+			req->no_block = 0;
+			return ret;
+		case TREE:
+			req->no_block = 1;
+			ret = tree_lock(req);
+			req->no_block = 0;
+			return ret;
+		default:
+			return lock_descriptor(req);
+	}
+}
+
+/*
+ * Function to unlock an open file descriptor
+ * The file descriptor will have been passed to us by the user.
+ #
+ * This function will only be used if the file lock operation
+ * was given a file descriptor by the user AND the lock type was
+ * flock.
+ */
+int unlock_descriptor(int fd) {
+	int retval = 1;
+	/*
+	 * Only need to handle flock lock type
+	 */
+	errno = 0;
+	if (flock(fd, LOCK_UN) == -1) {
+		printf("Failed to unlock file (fd = %i): %s\n", fd, strerror(errno));
+		retval = 0;
+	}
+	else {
+		printf("Unlocked file descriptor %i\n", fd);
+	}
+	return retval;
+}
+
+/*
+ * Statistics functions
+ *
+ * Every lock gets a slot in a table kept in shared memory, keyed by
+ * a hash of its absolute path. Each flock process that requests,
+ * acquires or releases the lock updates the slot with atomic adds,
+ * so no extra locking is needed on the lock paths. `flock --stats`
+ * dumps the table.
+ *
+ * Holders and waiters act on what they find in the table, so each user
+ * gets a table of their own that nobody else can write to. Once the
+ * table is full, the least recently used slot with nobody holding or
+ * waiting for its lock is given to the new lock.
+ *
+ * Updates that touch several fields at once (acquire, release) are
+ * also wrapped in a per-slot seqlock so that `flock --top` can take
+ * consistent snapshots without ever blocking the lock paths. Writers
+ * give up rather than spin forever if a process died mid-update.
+ *
+ * Wait and hold times are kept in HDR-style log-linear histograms of
+ * microseconds: STATS_SUB_BUCKETS linear buckets per power of two,
+ * giving a relative error of at most 1/STATS_SUB_BUCKETS.
+ */
+
+int hist_bucket(uint64_t us) {
+	int exp;
+
+	if (us < STATS_SUB_BUCKETS)
+		return (int)us;
+
+	exp = 63 - __builtin_clzll(us);
+	if (exp > STATS_MAX_EXP)
+		return STATS_BUCKETS - 1;
+	return (exp - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS
+	       + (int)((us >> (exp - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1));
+}
+
+/*
+ * Lowest value (in microseconds) that falls into a histogram bucket
+ */
+uint64_t hist_value(int bucket) {
+	int exp;
+
+	if (bucket < STATS_SUB_BUCKETS)
+		return bucket;
+
+	exp = bucket / STATS_SUB_BUCKETS + STATS_SUB_BITS - 1;
+	return (uint64_t)(STATS_SUB_BUCKETS + bucket % STATS_SUB_BUCKETS) << (exp - STATS_SUB_BITS);
+}
+
+/*
+ * Value (in microseconds) below which the given fraction of samples fall
+ */
+uint64_t hist_percentile(const uint32_t *hist, double fraction) {
+	uint64_t total = 0,
+	         seen  = 0,
+	         target;
+	int      i;
+
+	for (i = 0; i < STATS_BUCKETS; i++)
+		total += hist[i];
+	if (total == 0)
+		return 0;
+
+	target = (uint64_t)(total * fraction);
+	if (target == 0)
+		target = 1;
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen >= target)
+			return hist_value(i);
+	}
+	return hist_value(STATS_BUCKETS - 1);
+}
+
+void hist_record(uint32_t *hist, uint64_t ns) {
+	__atomic_fetch_add(&hist[hist_bucket(ns / 1000)], 1, __ATOMIC_RELAXED);
+}
+
+void stats_add(uint64_t *counter, uint64_t n) {
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Map the shared statistics table, creating it if necessary
+ * Statistics are best effort - returns NULL if they are unavailable
+ */
+void stats_name(char *name, size_t len) {
+	snprintf(name, len, STATS_SHM_NAME, (unsigned)geteuid());
+}
+
+struct stats_table *stats_open(void) {
+	static struct stats_table *table = NULL;
+	struct stat                st;
+	char                       name[64];
+	int                        fd;
+
+	if (table)
+		return table;
+
+	stats_name(name, sizeof(name));
+	if ((fd = shm_open(name, O_CREAT | O_RDWR, 0600)) < 0)
+		return NULL;
+
+	/*
+	 * Don't trust a table someone else created in our name
+	 */
+	if (fstat(fd, &st) < 0 || st.st_uid != geteuid() || (st.st_mode & 077)) {
+		close(fd);
+		errno = EPERM;
+		return NULL;
+	}
+	if (st.st_size < (off_t)sizeof(struct stats_table))
+		ftruncate(fd, sizeof(struct stats_table));
+
+	table = mmap(NULL, sizeof(struct stats_table), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (table == MAP_FAILED)
+		table = NULL;
+	return table;
+}
+
+/*
+ * Check whether a process recorded in the table has gone away
+ * A zombie counts as gone - a holder child killed while its parent
+ * still waits for a signal stays unreaped until the parent times out.
+ */
+int stats_pid_dead(int32_t pid) {
+	char  path[64],
+	      buf[256],
+	     *state;
+	FILE *f;
+
+	if (pid <= 0)
+		return 0;
+	if (kill(pid, 0) < 0)
+		return errno == ESRCH;
+
+	snprintf(path, sizeof(path), "/proc/%i/stat", pid);
+	if ((f = fopen(path, "r")) == NULL)
+		return 0;
+	state = fgets(buf, sizeof(buf), f) ? strrchr(buf, ')') : NULL;
+	fclose(f);
+	return state && state[1] == ' ' && state[2] == 'Z';
+}
+
+/*
+ * Waiters are recorded by PID rather than counted, so that a waiter
+ * killed outright is dropped from the count by whoever next looks
+ * instead of holding a place in the queue forever
+ */
+int32_t *waiting_entry = NULL;
+
+void stats_waiting(struct lock_request *req) {
+	int32_t empty;
+	int     i;
+
+	if (req->stats == NULL)
+		return;
+	for (i = 0; i < STATS_WAITERS; i++) {
+		empty = 0;
+		if (__atomic_compare_exchange_n(&req->stats->waiters[i], &empty, getpid(), 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			waiting_entry = &req->stats->waiters[i];
+			return;
+		}
+	}
+}
+
+void stats_done_waiting(void) {
+	if (waiting_entry == NULL)
+		return;
+	__atomic_store_n(waiting_entry, 0, __ATOMIC_RELEASE);
+	waiting_entry = NULL;
+}
+
+/*
+ * Count the live waiters for a lock, clearing out dead ones
+ * Saturates at STATS_WAITERS.
+ */
+int stats_waiters(struct lock_stats *slot) {
+	int32_t pid;
+	int     i,
+	        n = 0;
+
+	for (i = 0; i < STATS_WAITERS; i++) {
+		pid = __atomic_load_n(&slot->waiters[i], __ATOMIC_ACQUIRE);
+		if (pid == 0)
+			continue;
+		if (stats_pid_dead(pid)) {
+			__atomic_compare_exchange_n(&slot->waiters[i], &pid, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+			continue;
+		}
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Set up a slot that has just been claimed for a lock
+ */
+void stats_claim(struct lock_stats *slot, const char *path) {
+	size_t len = strlen(path);
+
+	memset((char *)slot + offsetof(struct lock_stats, path), 0,
+	       sizeof(*slot) - offsetof(struct lock_stats, path));
+	if (len >= STATS_PATH_LEN)
+		len = STATS_PATH_LEN - 1;
+	memcpy(slot->path, path, len);
+	__atomic_store_n(&slot->last_used_ns, now_ns(), __ATOMIC_RELAXED);
+}
+
+/*
+ * Check whether nobody holds, waits for or queues on a slot's lock
+ */
+int stats_idle(struct lock_stats *slot) {
+	int32_t pid;
+	int     i;
+
+	if (stats_waiters(slot) > 0)
+		return 0;
+	pid = __atomic_load_n(&slot->holder, __ATOMIC_RELAXED);
+	if (pid && !stats_pid_dead(pid))
+		return 0;
+	for (i = 0; i < STATS_DEADLINES; i++) {
+		if (__atomic_load_n(&slot->deadlines[i].pid, __ATOMIC_RELAXED))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Find the statistics slot for a lock file, claiming a free one if
+ * this is the first time the lock has been seen
+ * Slots are never emptied, only handed over from one lock to another,
+ * so that no other lock's probe sequence is cut short.
+ */
+struct lock_stats *stats_lookup(const char *filename) {
+	struct stats_table *table;
+	struct lock_stats  *slot,
+	                   *victim = NULL;
+	char                path[PATH_MAX];
+	uint64_t            key,
+	                    old;
+	int                 i;
+
+	if (filename == NULL || (table = stats_open()) == NULL)
+		return NULL;
+
+	stats_path(filename, path);
+	key = stats_hash(path);
+
+	for (i = 0; i < STATS_MAX_LOCKS; i++) {
+		slot = &table->locks[(key + i) % STATS_MAX_LOCKS];
+		old  = 0;
+		if (__atomic_compare_exchange_n(&slot->key, &old, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			stats_claim(slot, path);
+			return slot;
+		}
+		if (old == key) {
+			__atomic_store_n(&slot->last_used_ns, now_ns(), __ATOMIC_RELAXED);
+			return slot;
+		}
+		if ((victim == NULL || slot->last_used_ns < victim->last_used_ns) && stats_idle(slot))
+			victim = slot;
+	}
+
+	/*
+	 * Table full - take over the idle slot used longest ago
+	 */
+	if (victim == NULL)
+		return NULL;
+	old = __atomic_load_n(&victim->key, __ATOMIC_ACQUIRE);
+	if (!__atomic_compare_exchange_n(&victim->key, &old, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return NULL;
+	stats_claim(victim, path);
+	return victim;
+}
+
+/*
+ * Find the statistics slot for a lock file without claiming one
+ * Returns NULL if the lock has never been seen.
+ */
+struct lock_stats *stats_find(const char *filename) {
+	struct stats_table *table;
+	struct lock_stats  *slot;
+	char                path[PATH_MAX];
+	uint64_t            key,
+	                    old;
+	int                 i;
+
+	if (filename == NULL || (table = stats_open()) == NULL)
+		return NULL;
+
+	stats_path(filename, path);
+	key = stats_hash(path);
+
+	for (i = 0; i < STATS_MAX_LOCKS; i++) {
+		slot = &table->locks[(key + i) % STATS_MAX_LOCKS];
+		if ((old = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE)) == key)
+			return slot;
+		if (old == 0)
+			break;
+	}
+	return NULL;
+}
+
+/*
+ * Function to take a slot for writing
+ * The writer records its PID, so that if it is killed mid-update the
+ * next writer can take over and finish the sequence rather than
+ * every later reader and writer spinning on it.
+ * Returns 1 if the slot was taken, or 0 if a live writer kept it.
+ */
+int stats_write_begin(struct lock_stats *slot) {
+	uint32_t seq;
+	int32_t  writer;
+	int      spins = 0;
+
+	do {
+		writer = 0;
+		if (__atomic_compare_exchange_n(&slot->writer, &writer, getpid(), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+		if (spins % STATS_REAP_SPINS == STATS_REAP_SPINS - 1 && stats_pid_dead(writer) &&
+		    __atomic_compare_exchange_n(&slot->writer, &writer, getpid(), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	} while (spins++ < STATS_SPIN_LIMIT);
+
+	if (spins > STATS_SPIN_LIMIT)
+		return 0;
+
+	/*
+	 * An odd sequence means a dead writer's update is being taken over
+	 */
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+	if (!(seq & 1))
+		__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return 1;
+}
+
+void stats_write_end(struct lock_stats *slot) {
+	__atomic_fetch_add(&slot->seq, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&slot->writer, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Take a consistent copy of a slot
+ * A slot left mid-update by a dead writer is closed off first.
+ * Falls back to a possibly torn copy if a live writer never finishes.
+ */
+void stats_snapshot(struct lock_stats *slot, struct lock_stats *copy) {
+	uint32_t before,
+	         after;
+	int      tries = 0;
+
+	do {
+		before = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if ((before & 1) && tries % STATS_REAP_SPINS == STATS_REAP_SPINS - 1 &&
+		    stats_pid_dead(__atomic_load_n(&slot->writer, __ATOMIC_RELAXED)) && stats_write_begin(slot)) {
+			stats_write_end(slot);
+			continue;
+		}
+		memcpy(copy, slot, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+	} while ((before != after || (before & 1)) && tries++ < STATS_SPIN_LIMIT);
+}
+
+void stats_acquired(struct lock_request *req) {
+	int locked;
+
+	stats_done_waiting();
+	req->acquired_ns = now_ns();
+	if (req->stats == NULL)
+		return;
+
+	locked = stats_write_begin(req->stats);
+	stats_add(&req->stats->acquires, 1);
+	stats_add(&req->stats->wait_ns, req->acquired_ns - req->requested_ns);
+	hist_record(req->stats->wait_hist, req->acquired_ns - req->requested_ns);
+	req->stats->holder        = getpid();
+	req->stats->held_since_ns = req->acquired_ns;
+	if (locked)
+		stats_write_end(req->stats);
+}
+
+void stats_released(struct lock_stats *slot, uint64_t acquired_ns) {
+	uint64_t held = now_ns() - acquired_ns;
+	int      locked;
+
+	if (slot == NULL)
+		return;
+
+	locked = stats_write_begin(slot);
+	stats_add(&slot->releases, 1);
+	stats_add(&slot->hold_ns, held);
+	hist_record(slot->hold_hist, held);
+	/*
+	 * Moving average of the last few hold times, for admission control
+	 */
+	slot->recent_hold_ns = slot->recent_hold_ns ? slot->recent_hold_ns - slot->recent_hold_ns / 8 + held / 8 : held;
+	if (slot->holder == getpid())
+		slot->holder = 0;
+	if (locked)
+		stats_write_end(slot);
+}
+
+/*
+ * Deadline scheduling
+ *
+ * The kernel wakes lock waiters in no particular order, so waiters
+ * that carry a deadline queue in the statistics slot as well and
+ * only try for the lock when theirs is the earliest deadline still
+ * waiting. Waiters without a deadline stand back while any deadline
+ * waiter is queued. Those already blocked in the kernel can't be
+ * overtaken, so this orders flock waiters on a best effort basis.
+ */
+
+/*
+ * Our entry in the deadline queue, cleared from atexit() if our
+ * parent gives up on us while we wait
+ */
+int32_t  *deadline_entry = NULL;
+uint64_t *deadline_time  = NULL;
+
+uint64_t realtime_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Free a deadline queue entry
+ * The deadline is cleared before the PID, so whoever claims the entry
+ * next never has the old deadline read as theirs. Both only change if
+ * they still hold what the caller saw.
+ */
+void deadline_free(struct lock_stats *slot, int i, int32_t pid, uint64_t deadline_ns) {
+	__atomic_compare_exchange_n(&slot->deadlines[i].deadline_ns, &deadline_ns, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+	__atomic_compare_exchange_n(&slot->deadlines[i].pid, &pid, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+void deadline_unregister(void) {
+	int32_t pid = getpid();
+
+	if (deadline_entry == NULL)
+		return;
+	__atomic_store_n(deadline_time, 0, __ATOMIC_RELEASE);
+	__atomic_compare_exchange_n(deadline_entry, &pid, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+	deadline_entry = NULL;
+	deadline_time  = NULL;
+}
+
+/*
+ * Queue for a lock with a deadline
+ * An entry whose deadline is still 0 is being set up and is passed
+ * over by everyone else until the deadline is published.
+ */
+int deadline_register(struct lock_stats *slot, uint64_t deadline_ns) {
+	int32_t empty;
+	int     i;
+
+	for (i = 0; i < STATS_DEADLINES; i++) {
+		empty = 0;
+		if (__atomic_compare_exchange_n(&slot->deadlines[i].pid, &empty, getpid(), 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&slot->deadlines[i].deadline_ns, deadline_ns, __ATOMIC_RELEASE);
+			deadline_entry = &slot->deadlines[i].pid;
+			deadline_time  = &slot->deadlines[i].deadline_ns;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Check whether some other live waiter should go before a waiter
+ * with the given deadline (0 meaning no deadline)
+ * Entries left by dead waiters, or whose deadline has passed, are
+ * freed - the PID of a waiter that gave up may since have been
+ * reused, and must not hold everyone else back.
+ */
+int deadline_ahead(struct lock_stats *slot, uint64_t deadline_ns) {
+	uint64_t theirs,
+	         now = realtime_ns();
+	int32_t  pid;
+	int      i;
+
+	for (i = 0; i < STATS_DEADLINES; i++) {
+		pid = __atomic_load_n(&slot->deadlines[i].pid, __ATOMIC_ACQUIRE);
+		if (pid == 0 || pid == getpid())
+			continue;
+		theirs = __atomic_load_n(&slot->deadlines[i].deadline_ns, __ATOMIC_ACQUIRE);
+		if ((theirs && theirs <= now) || stats_pid_dead(pid)) {
+			deadline_free(slot, i, pid, theirs);
+			continue;
+		}
+		if (theirs == 0)
+			continue;
+		if (deadline_ns == 0 || theirs < deadline_ns || (theirs == deadline_ns && pid < getpid()))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Function to wait for our turn at a lock under deadline scheduling
+ * Returns 1 if the lock was taken here, 0 if the caller should go on
+ * to take it as usual, or -1 if the deadline was missed.
+ */
+int deadline_wait(struct lock_request *req) {
+	struct timespec poll = {0, DEADLINE_POLL_NS};
+
+	if (req->stats == NULL || req->no_block)
+		return 0;
+
+	if (req->deadline_ns == 0) {
+		while (deadline_ahead(req->stats, 0))
+			nanosleep(&poll, NULL);
+		return 0;
+	}
+
+	if (!deadline_register(req->stats, req->deadline_ns))
+		return 0;
+
+	for (;;) {
+		if (realtime_ns() >= req->deadline_ns) {
+			deadline_unregister();
+			return -1;
+		}
+		if (!deadline_ahead(req->stats, req->deadline_ns) && try_lock(req)) {
+			deadline_unregister();
+			return 1;
+		}
+		nanosleep(&poll, NULL);
+	}
+}
+
+/*
+ * Admission control
+ *
+ * Estimate how long a new request would wait: whatever is left of the
+ * current hold plus one recent average hold for each waiter already
+ * queued. Requests that can't be served in time are turned away before
+ * they fork, instead of piling up until their timeouts fire.
+ * Waiters and holders that have died are left out, so a lock whose
+ * users were killed doesn't turn requests away for good.
+ */
+uint64_t predict_wait(struct lock_stats *slot, int waiters) {
+	struct lock_stats snap;
+	uint64_t          remaining = 0,
+	                  held;
+
+	stats_snapshot(slot, &snap);
+	if (snap.recent_hold_ns == 0)
+		return 0;
+
+	if (snap.holder && !stats_pid_dead(snap.holder)) {
+		held = now_ns() - snap.held_since_ns;
+		if (held < snap.recent_hold_ns)
+			remaining = snap.recent_hold_ns - held;
+	}
+	return remaining + (uint64_t)waiters * snap.recent_hold_ns;
+}
+
+/*
+ * Function to decide whether to queue a request at all
+ * Returns 1 to admit it, 0 if it has been rejected
+ */
+int admit_request(struct lock_request *req) {
+	struct lock_stats *slot;
+	uint64_t           predicted;
+	int                waiters;
+
+	if ((slot = stats_lookup(req->filename)) == NULL)
+		return 1;
+
+	waiters = stats_waiters(slot);
+	if (req->max_waiters && waiters >= req->max_waiters) {
+		printf("Rejected: %i waiters already queued for %s\n", waiters, req->filename);
+		return 0;
+	}
+
+	if (req->timeout > 0) {
+		predicted = predict_wait(slot, waiters);
+		if (predicted > (uint64_t)req->timeout * 1000000000) {
+			printf("Rejected: predicted wait of %.1fs for %s exceeds %is\n",
+			       predicted / 1e9, req->filename, req->timeout);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * The lock currently held by this process, released from atexit()
+ * because UNLOCK exits straight from the signal handler
+ */
+struct lock_request *held_req = NULL;
+
+void stats_exit(void) {
+	stats_done_waiting();
+	deadline_unregister();
+	if (held_req)
+		stats_released(held_req->stats, held_req->acquired_ns);
+}
+
+void print_hist(const char *name, const uint32_t *hist, uint64_t count, uint64_t sum_ns) {
+	printf("  %s  mean %.3fms  p50 %.3fms  p90 %.3fms  p99 %.3fms  max %.3fms\n", name,
+	       count ? sum_ns / 1e6 / count : 0.0,
+	       hist_percentile(hist, 0.50) / 1e3,
+	       hist_percentile(hist, 0.90) / 1e3,
+	       hist_percentile(hist, 0.99) / 1e3,
+	       hist_percentile(hist, 1.0) / 1e3);
+}
+
+/*
+ * Function to dump the statistics table
+ */
+int print_stats(void) {
+	struct stats_table *table;
+	struct lock_stats  *slot;
+	int                 i;
+
+	if ((table = stats_open()) == NULL) {
+		printf("Failed to open statistics: %s\n", strerror(errno));
+		return 1;
+	}
+
+	for (i = 0; i < STATS_MAX_LOCKS; i++) {
+		slot = &table->locks[i];
+		if (slot->key == 0)
+			continue;
+		printf("%s\n", slot->path);
+		printf("  acquires %llu  releases %llu  busy %llu  timeouts %llu  failures %llu  stale %llu\n",
+		       (unsigned long long)slot->acquires,
+		       (unsigned long long)slot->releases,
+		       (unsigned long long)slot->busy,
+		       (unsigned long long)slot->timeouts,
+		       (unsigned long long)slot->failures,
+		       (unsigned long long)slot->stale);
+		print_hist("wait", slot->wait_hist, slot->acquires, slot->wait_ns);
+		print_hist("hold", slot->hold_hist, slot->releases, slot->hold_ns);
+	}
+	return 0;
+}
+
+/*
+ * Trace functions
+ *
+ * Setting FLOCK_TRACE_DIR makes every flock process record its lock
+ * events into a ring buffer file of its own in that directory. The
+ * rings are plain mmap'ed files so nothing is lost if a process is
+ * killed, and `flock --trace-export DIR` merges them into Chrome
+ * trace-event JSON, with one track per lock showing who was waiting
+ * for it and who was holding it. Exporting removes the rings of
+ * processes that have exited, as nothing more will be added to them.
+ */
+
+struct trace_ring *trace_open(void) {
+	static struct trace_ring *ring     = NULL;
+	static int                ring_pid = 0;
+	char                      path[PATH_MAX];
+	const char               *dir;
+	int                       fd;
+
+	/*
+	 * A forked child needs a ring of its own
+	 */
+	if (ring_pid == getpid())
+		return ring;
+	if (ring)
+		munmap(ring, sizeof(*ring));
+	ring     = NULL;
+	ring_pid = getpid();
+
+	if ((dir = getenv(TRACE_ENV)) == NULL || *dir == '\0')
+		return NULL;
+
+	snprintf(path, sizeof(path), "%s/flock-%i.ring", dir, ring_pid);
+	if ((fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0644)) < 0)
+		return NULL;
+	if (ftruncate(fd, sizeof(struct trace_ring)) == 0)
+		ring = mmap(NULL, sizeof(*ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (ring == MAP_FAILED) {
+		ring = NULL;
+		return NULL;
+	}
+	ring->magic    = TRACE_MAGIC;
+	ring->capacity = TRACE_CAPACITY;
+	return ring;
+}
+
+/*
+ * Record an event against a lock
+ * The session is the PID of the holder process the event concerns,
+ * which pairs up events from the parent, the child and later unlock
+ * or await calls.
+ */
+void trace_record(enum trace_type type, const char *filename, int session, uint64_t ts_ns) {
+	struct trace_ring  *ring;
+	struct trace_event *ev;
+	char                path[PATH_MAX];
+	size_t              len;
+
+	if (filename == NULL || (ring = trace_open()) == NULL)
+		return;
+
+	stats_path(filename, path);
+	if ((len = strlen(path)) >= TRACE_PATH_LEN)
+		len = TRACE_PATH_LEN - 1;
+	ev = &ring->events[__atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED) % TRACE_CAPACITY];
+	ev->ts_ns   = ts_ns;
+	ev->pid     = getpid();
+	ev->session = session;
+	ev->type    = type;
+	memcpy(ev->path, path, len);
+	ev->path[len] = '\0';
+}
+
+int compare_trace_events(const void *a, const void *b) {
+	const struct trace_event *x = a,
+	                         *y = b;
+
+	return (x->ts_ns > y->ts_ns) - (x->ts_ns < y->ts_ns);
+}
+
+void print_json_string(const char *str) {
+	putchar('"');
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			printf("\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			printf("\\u%04x", *str);
+		else
+			putchar(*str);
+	}
+	putchar('"');
+}
+
+/*
+ * Function to merge the trace rings in a directory into Chrome JSON
+ * Each lock becomes a "process" whose tracks are async spans, one per
+ * requesting session, so overlapping waiters show up side by side.
+ * Async span ids are global, so they are made up of the session and
+ * the lock - a chain holds several locks in one session.
+ */
+int export_trace(const char *dir) {
+	static const char *span_names[] = {
+		[TRACE_REQUEST]  = "wait",
+		[TRACE_ACQUIRE]  = "hold",
+		[TRACE_FAIL]     = "wait",
+		[TRACE_TIMEOUT]  = "wait",
+		[TRACE_RELEASE]  = "hold",
+		[TRACE_UNLOCK]   = "unlock signal",
+	};
+	struct trace_event *events = NULL,
+	                   *ev,
+	                   *grown;
+	struct trace_ring  *ring;
+	struct dirent      *ent;
+	DIR                *d;
+	char                path[PATH_MAX];
+	uint64_t           *lock_keys = NULL,
+	                   *more_keys,
+	                    key,
+	                    count,
+	                    i;
+	size_t              n_events = 0,
+	                    n_locks  = 0,
+	                    lock;
+	int                 fd,
+	                    pid,
+	                    first = 1;
+
+	errno = 0;
+	if ((d = opendir(dir)) == NULL) {
+		printf("Failed to open directory %s: %s\n", dir, strerror(errno));
+		return 1;
+	}
+
+	while ((ent = readdir(d)) != NULL) {
+		if (strncmp(ent->d_name, "flock-", 6) != 0 || strstr(ent->d_name, ".ring") == NULL)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+		if ((fd = open(path, O_RDONLY)) < 0)
+			continue;
+		ring = mmap(NULL, sizeof(*ring), PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (ring == MAP_FAILED)
+			continue;
+		if (ring->magic != TRACE_MAGIC) {
+			munmap(ring, sizeof(*ring));
+			continue;
+		}
+
+		/*
+		 * Only the newest TRACE_CAPACITY events survive a wrap
+		 */
+		count = (ring->head < TRACE_CAPACITY) ? ring->head : TRACE_CAPACITY;
+		if ((grown = realloc(events, (n_events + count) * sizeof(*events))) == NULL) {
+			printf("Failed to read trace %s: %s\n", path, strerror(errno));
+			munmap(ring, sizeof(*ring));
+			closedir(d);
+			free(events);
+			return 1;
+		}
+		events = grown;
+		for (i = ring->head - count; i < ring->head; i++)
+			events[n_events++] = ring->events[i % TRACE_CAPACITY];
+		munmap(ring, sizeof(*ring));
+
+		if (sscanf(ent->d_name, "flock-%i.ring", &pid) == 1 && stats_pid_dead(pid))
+			unlink(path);
+	}
+	closedir(d);
+
+	qsort(events, n_events, sizeof(*events), compare_trace_events);
+
+	printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for (i = 0; i < n_events; i++) {
+		ev  = &events[i];
+		key = stats_hash(ev->path);
+
+		/*
+		 * First sighting of a lock - give it a track named after the path
+		 */
+		for (lock = 0; lock < n_locks && lock_keys[lock] != key; lock++)
+			;
+		if (lock == n_locks) {
+			if ((more_keys = realloc(lock_keys, (n_locks + 1) * sizeof(*lock_keys))) == NULL) {
+				printf("\n]}\n");
+				free(events);
+				free(lock_keys);
+				return 1;
+			}
+			lock_keys = more_keys;
+			lock_keys[n_locks++] = key;
+			printf("%s{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%zu,\"args\":{\"name\":", first ? "" : ",\n", lock + 1);
+			print_json_string(ev->path);
+			printf("}}");
+			first = 0;
+		}
+
+		printf(",\n{\"pid\":%zu,\"tid\":%i,\"ts\":%.3f,\"cat\":\"lock\",\"name\":\"%s\",",
+		       lock + 1, ev->pid, ev->ts_ns / 1e3, span_names[ev->type]);
+		switch (ev->type) {
+			case TRACE_REQUEST:
+				printf("\"ph\":\"b\",\"id\":\"%i.%zu\",\"args\":{\"session\":%i}}", ev->session, lock + 1, ev->session);
+				break;
+			case TRACE_ACQUIRE:
+				printf("\"ph\":\"b\",\"id\":\"%i.%zu\",\"args\":{\"session\":%i}}", ev->session, lock + 1, ev->session);
+				printf(",\n{\"pid\":%zu,\"tid\":%i,\"ts\":%.3f,\"cat\":\"lock\",\"name\":\"wait\",\"ph\":\"e\",\"id\":\"%i.%zu\"}",
+				       lock + 1, ev->pid, ev->ts_ns / 1e3, ev->session, lock + 1);
+				break;
+			case TRACE_FAIL:
+			case TRACE_TIMEOUT:
+				printf("\"ph\":\"e\",\"id\":\"%i.%zu\",\"args\":{\"result\":\"%s\"}}", ev->session, lock + 1,
+				       ev->type == TRACE_FAIL ? "failed" : "timeout");
+				break;
+			case TRACE_RELEASE:
+				printf("\"ph\":\"e\",\"id\":\"%i.%zu\"}", ev->session, lock + 1);
+				break;
+			case TRACE_UNLOCK:
+				printf("\"ph\":\"i\",\"s\":\"p\"}");
+				break;
+		}
+	}
+	printf("\n]}\n");
+
+	free(events);
+	free(lock_keys);
+	return 0;
+}
+
+/*
+ * Lock order functions
+ *
+ * With FLOCK_LOCKDEP set to a file, every lock request made by a script
+ * that already holds other locks adds an edge held -> requested to a
+ * lock order graph kept in that file, shared by everyone using it. An
+ * edge that closes a cycle means two scripts take the same locks in
+ * different orders and can deadlock, so the cycle is reported the first
+ * time it appears, along with where each of its edges was recorded -
+ * before the deadlock ever happens.
+ *
+ * The graph is plain text, one tab-separated edge per line:
+ *   E <from> <to> <time recorded> <call site>
+ * Edges are only ever appended, each with a single write, and only when
+ * new, so reading the graph needs no lock and a request whose script
+ * holds nothing else never reads it at all. Past LOCKDEP_MAX_EDGES the
+ * graph is rewritten with just the newer half, so orders not seen in a
+ * long time are forgotten until they are seen again.
+ *
+ * The locks each script holds are files in FILE.held/<script pid>/,
+ * one per holder and lock, holding the lock's path. Each holder keeps
+ * its own entries in memory and removes them with unlink(), which is
+ * safe from a signal handler, and entries left by holders that died
+ * are removed by the next script to look.
+ */
+struct lockdep_edge {
+	char    *from;
+	char    *to;
+	char    *callsite;
+	uint64_t recorded;
+	int      visited;
+};
+
+struct lockdep_graph {
+	char                *buf;
+	struct lockdep_edge *edges;
+	int                  n_edges;
+};
+
+/*
+ * Held entries of this process - one lock, or two while a chain moves
+ * from one stage to the next
+ */
+struct lockdep_held {
+	const char *filename;
+	char        entry[PATH_MAX];
+	char        dir[PATH_MAX];
+} lockdep_held[LOCKDEP_MAX_HELD];
+
+/*
+ * Function to find the directory of held entries for a script
+ * Returns 0 if lockdep is off.
+ */
+int lockdep_dir(int session, char *dir) {
+	const char *file;
+
+	if ((file = getenv(LOCKDEP_ENV)) == NULL || *file == '\0')
+		return 0;
+	if (session)
+		snprintf(dir, PATH_MAX, "%s.held/%i", file, session);
+	else
+		snprintf(dir, PATH_MAX, "%s.held", file);
+	return 1;
+}
+
+/*
+ * Function to read the lock order graph without locking it
+ * A line still being appended has no newline yet and is left out.
+ * Returns 0 if the graph can't be read.
+ */
+int lockdep_read(struct lockdep_graph *g) {
+	const char          *file = getenv(LOCKDEP_ENV);
+	struct lockdep_edge *edges;
+	struct stat          st;
+	char                *line,
+	                    *next,
+	                    *f[5];
+	ssize_t              len;
+	int                  fd,
+	                     max = 0,
+	                     i;
+
+	memset(g, 0, sizeof(*g));
+	if ((fd = open(file, O_RDONLY | O_CLOEXEC)) < 0)
+		return errno == ENOENT;
+	if (fstat(fd, &st) < 0 || (g->buf = malloc(st.st_size + 1)) == NULL) {
+		close(fd);
+		return 0;
+	}
+	len = pread(fd, g->buf, st.st_size, 0);
+	close(fd);
+	g->buf[len > 0 ? len : 0] = '\0';
+
+	for (line = g->buf; (next = strchr(line, '\n')) != NULL; line = next) {
+		*next++ = '\0';
+		for (i = 0; i < 5 && line; i++)
+			f[i] = strsep(&line, "\t");
+		if (i < 5 || strcmp(f[0], "E") != 0)
+			continue;
+		if (g->n_edges == max) {
+			max = max ? max * 2 : 64;
+			if ((edges = realloc(g->edges, max * sizeof(*edges))) == NULL)
+				return 0;
+			g->edges = edges;
+		}
+		g->edges[g->n_edges].from     = f[1];
+		g->edges[g->n_edges].to       = f[2];
+		g->edges[g->n_edges].recorded = strtoull(f[3], NULL, 10);
+		g->edges[g->n_edges].callsite = f[4];
+		g->edges[g->n_edges].visited  = 0;
+		g->n_edges++;
+	}
+	return 1;
+}
+
+void lockdep_free(struct lockdep_graph *g) {
+	free(g->edges);
+	free(g->buf);
+}
+
+int compare_lockdep_edges(const void *a, const void *b) {
+	const struct lockdep_edge *x = a,
+	                          *y = b;
+
+	return (x->recorded < y->recorded) - (x->recorded > y->recorded);
+}
+
+/*
+ * Function to cut a graph that has grown too big down to its newer half
+ * Only one process does this at a time, and the new graph is renamed
+ * into place so readers never see it half written. An edge appended to
+ * the old graph meanwhile is lost, and recorded again the next time
+ * its order is seen.
+ */
+void lockdep_prune(struct lockdep_graph *g) {
+	const char *file = getenv(LOCKDEP_ENV);
+	char        tmp[PATH_MAX];
+	FILE       *out;
+	int         fd,
+	            i;
+
+	if ((fd = open(file, O_RDONLY | O_CLOEXEC)) < 0)
+		return;
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+		close(fd);
+		return;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.%i.tmp", file, getpid());
+	if ((out = fopen(tmp, "w")) != NULL) {
+		qsort(g->edges, g->n_edges, sizeof(*g->edges), compare_lockdep_edges);
+		for (i = 0; i < g->n_edges && i < LOCKDEP_MAX_EDGES / 2; i++)
+			fprintf(out, "E\t%s\t%s\t%llu\t%s\n", g->edges[i].from, g->edges[i].to,
+			        (unsigned long long)g->edges[i].recorded, g->edges[i].callsite);
+		if (fclose(out) != 0 || rename(tmp, file) < 0)
+			unlink(tmp);
+	}
+	close(fd);
+}
+
+/*
+ * Function to add an edge to the graph with a single appending write
+ */
+void lockdep_append(const char *from, const char *to, const char *site) {
+	char buf[2 * PATH_MAX + LOCKDEP_SITE_LEN + 32];
+	int  fd,
+	     len;
+
+	len = snprintf(buf, sizeof(buf), "E\t%s\t%s\t%llu\t%s\n", from, to, (unsigned long long)time(NULL), site);
+	if (len >= (int)sizeof(buf))
+		return;
+	if ((fd = open(getenv(LOCKDEP_ENV), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) < 0)
+		return;
+	write(fd, buf, len);
+	close(fd);
+}
+
+/*
+ * Function to find a path of edges from one lock to another
+ * Fills in the edges on the path and returns how many there are, or
+ * 0 if there is no path.
+ */
+int lockdep_path(struct lockdep_graph *g, const char *from, const char *to, int *path, int depth) {
+	int i,
+	    len;
+
+	for (i = 0; i < g->n_edges; i++) {
+		if (g->edges[i].visited || strcmp(g->edges[i].from, from) != 0)
+			continue;
+		g->edges[i].visited = 1;
+		path[depth] = i;
+		if (strcmp(g->edges[i].to, to) == 0)
+			return depth + 1;
+		if ((len = lockdep_path(g, g->edges[i].to, to, path, depth + 1)) > 0)
+			return len;
+	}
+	return 0;
+}
+
+/*
+ * Function to describe where a lock request comes from
+ * The --callsite given, or the calling script's command line.
+ */
+void lockdep_callsite(struct lock_request *req, char *site) {
+	char    path[64];
+	ssize_t len = 0;
+	int     fd,
+	        i;
+
+	if (req->callsite)
+		len = snprintf(site, LOCKDEP_SITE_LEN, "%s", req->callsite);
+	else {
+		snprintf(path, sizeof(path), "/proc/%i/cmdline", req->script_pid);
+		if ((fd = open(path, O_RDONLY)) >= 0) {
+			len = read(fd, site, LOCKDEP_SITE_LEN - 1);
+			close(fd);
+		}
+		while (len > 0 && site[len - 1] == '\0')
+			len--;
+		if (len < 0)
+			len = 0;
+		len += snprintf(site + len, LOCKDEP_SITE_LEN - len, "%s[%i]", len ? " " : "", req->script_pid);
+	}
+
+	if (len >= LOCKDEP_SITE_LEN)
+		len = LOCKDEP_SITE_LEN - 1;
+	site[len] = '\0';
+	for (i = 0; i < len; i++) {
+		if (site[i] == '\0' || site[i] == '\t' || site[i] == '\n')
+			site[i] = ' ';
+	}
+}
+
+/*
+ * Function to list the locks a script holds, other than the one given
+ * Entries left by holders that have died are removed on the way.
+ * Returns the number of locks, with their paths in *held, or -1 if
+ * they can't be listed.
+ */
+int lockdep_holds(int session, const char *except, char (**held)[PATH_MAX]) {
+	char            dir[PATH_MAX],
+	                entry[PATH_MAX],
+	              (*more)[PATH_MAX];
+	struct dirent  *ent;
+	DIR            *d;
+	ssize_t         len;
+	int             fd,
+	                n   = 0,
+	                max = 0;
+
+	*held = NULL;
+	if (!lockdep_dir(session, dir) || (d = opendir(dir)) == NULL)
+		return 0;
+
+	while ((ent = readdir(d)) != NULL) {
+		if (ent->d_name[0] == '.')
+			continue;
+		if (snprintf(entry, sizeof(entry), "%s/%s", dir, ent->d_name) >= (int)sizeof(entry))
+			continue;
+		if (stats_pid_dead((int32_t)strtol(ent->d_name, NULL, 10))) {
+			unlink(entry);
+			continue;
+		}
+		if (n == max) {
+			max = max ? max * 2 : 4;
+			if ((more = realloc(*held, max * sizeof(**held))) == NULL) {
+				closedir(d);
+				return -1;
+			}
+			*held = more;
+		}
+		if ((fd = open(entry, O_RDONLY | O_CLOEXEC)) < 0)
+			continue;
+		len = read(fd, (*held)[n], PATH_MAX - 1);
+		close(fd);
+		if (len <= 0)
+			continue;
+		(*held)[n][len] = '\0';
+		if (strcmp((*held)[n], except) != 0)
+			n++;
+	}
+	closedir(d);
+	rmdir(dir);
+	return n;
+}
+
+/*
+ * Function to record the order of a lock request against the locks its
+ * script already holds, and report any inversion it creates
+ */
+void lockdep_check(struct lock_request *req) {
+	struct lockdep_graph g;
+	char                 path[PATH_MAX],
+	                     site[LOCKDEP_SITE_LEN],
+	                   (*held)[PATH_MAX];
+	int                 *cycle,
+	                     n_held,
+	                     len,
+	                     i,
+	                     j;
+
+	/*
+	 * Without FLOCK_LOCKDEP this costs nothing but the getenv()
+	 */
+	if (req->filename == NULL || !lockdep_dir(0, path))
+		return;
+	stats_path(req->filename, path);
+	if ((n_held = lockdep_holds(req->script_pid, path, &held)) <= 0)
+		return;
+	if (!lockdep_read(&g) || (cycle = calloc(g.n_edges + 1, sizeof(*cycle))) == NULL) {
+		lockdep_free(&g);
+		free(held);
+		return;
+	}
+	lockdep_callsite(req, site);
+	if (g.n_edges >= LOCKDEP_MAX_EDGES)
+		lockdep_prune(&g);
+
+	for (i = 0; i < n_held; i++) {
+		for (j = 0; j < g.n_edges; j++) {
+			if (strcmp(g.edges[j].from, held[i]) == 0 && strcmp(g.edges[j].to, path) == 0)
+				break;
+		}
+		if (j < g.n_edges)
+			continue;
+
+		/*
+		 * A new order - does the graph already have the reverse?
+		 */
+		for (j = 0; j < g.n_edges; j++)
+			g.edges[j].visited = 0;
+		if ((len = lockdep_path(&g, path, held[i], cycle, 0)) > 0) {
+			printf("Lock order inversion: %s wanted while holding %s\n", path, held[i]);
+			printf("  %s -> %s at %s\n", held[i], path, site);
+			for (j = 0; j < len; j++)
+				printf("  %s -> %s at %s\n", g.edges[cycle[j]].from, g.edges[cycle[j]].to, g.edges[cycle[j]].callsite);
+		}
+		lockdep_append(held[i], path, site);
+	}
+
+	free(cycle);
+	lockdep_free(&g);
+	free(held);
+}
+
+/*
+ * Function to add or drop our lock in the held entries of its script
+ * Dropping only unlinks what was recorded when the lock was taken, so
+ * it is safe from the exit path of a signal handler.
+ */
+void lockdep_update(struct lock_request *req, const char *filename, int held) {
+	struct lockdep_held *h;
+	char                 path[PATH_MAX],
+	                     root[PATH_MAX];
+	int                  fd = -1,
+	                     i;
+
+	if (filename == NULL)
+		return;
+	if (!held) {
+		for (i = 0; i < LOCKDEP_MAX_HELD; i++) {
+			h = &lockdep_held[i];
+			if (h->filename && strcmp(h->filename, filename) == 0) {
+				unlink(h->entry);
+				rmdir(h->dir);
+				h->filename = NULL;
+			}
+		}
+		return;
+	}
+
+	for (i = 0, h = NULL; i < LOCKDEP_MAX_HELD && h == NULL; i++) {
+		if (lockdep_held[i].filename == NULL)
+			h = &lockdep_held[i];
+	}
+	if (h == NULL || !lockdep_dir(req->script_pid, h->dir) || !lockdep_dir(0, root))
+		return;
+
+	stats_path(filename, path);
+	if (snprintf(h->entry, sizeof(h->entry), "%s/%i-%016llx", h->dir, getpid(),
+	             (unsigned long long)stats_hash(path)) >= (int)sizeof(h->entry))
+		return;
+
+	/*
+	 * The script's directory can be removed by another of its holders
+	 * between our mkdir and open, so have a second go
+	 */
+	for (i = 0; i < 2 && fd < 0; i++) {
+		mkdir(root, 0755);
+		mkdir(h->dir, 0755);
+		fd = open(h->entry, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644);
+	}
+	if (fd < 0)
+		return;
+	write(fd, path, strlen(path));
+	close(fd);
+	h->filename = filename;
+}
+
+/*
+ * /proc/locks functions
+ *
+ * The kernel lists every file lock, of every type, in /proc/locks:
+ *
+ *   1: FLOCK  ADVISORY  WRITE 1234 08:01:131090 0 EOF
+ *   1: -> FLOCK  ADVISORY  WRITE 5678 08:01:131090 0 EOF
+ *
+ * Lines with "->" are processes blocked waiting for the lock above.
+ * The file is read in one go and parsed in a single pass with no
+ * allocation per line, matching (dev, inode) against a hash of the
+ * files asked about, so many paths can be answered with one scan.
+ */
+
+int add_proc_lock(struct lock_target *target, const struct proc_lock *lock) {
+	struct proc_lock *locks;
+	int               max = target->max_locks ? target->max_locks * 2 : 4;
+
+	if (target->n_locks == target->max_locks) {
+		if ((locks = realloc(target->locks, max * sizeof(*locks))) == NULL)
+			return 0;
+		target->locks     = locks;
+		target->max_locks = max;
+	}
+	target->locks[target->n_locks++] = *lock;
+	if (lock->waiter)
+		target->n_waiters++;
+	else
+		target->n_holders++;
+	return 1;
+}
+
+/*
+ * Copy the next space separated field, returning a pointer past it
+ */
+const char *proc_field(const char *p, const char *end, char *out, size_t len) {
+	size_t n = 0;
+
+	while (p < end && *p == ' ')
+		p++;
+	while (p < end && *p != ' ') {
+		if (n < len - 1)
+			out[n++] = *p;
+		p++;
+	}
+	out[n] = '\0';
+	return p;
+}
+
+const char *proc_number(const char *p, const char *end, int base, long long *out) {
+	int neg = 0;
+
+	*out = 0;
+	while (p < end && *p == ' ')
+		p++;
+	if (p < end && *p == '-') {
+		neg = 1;
+		p++;
+	}
+	for (; p < end; p++) {
+		int digit;
+
+		if (*p >= '0' && *p <= '9')
+			digit = *p - '0';
+		else if (base == 16 && *p >= 'a' && *p <= 'f')
+			digit = *p - 'a' + 10;
+		else
+			break;
+		*out = *out * base + digit;
+	}
+	if (neg)
+		*out = -*out;
+	return p;
+}
+
+/*
+ * Function to read the whole of /proc/locks into a buffer
+ * Returns the length read, or -1 on error
+ */
+ssize_t read_proc_locks(char **buf) {
+	size_t  size = 1 << 16,
+	        len  = 0;
+	ssize_t n;
+	char   *bigger;
+	int     fd;
+
+	errno = 0;
+	if ((fd = open(PROC_LOCKS, O_RDONLY)) < 0)
+		return -1;
+
+	if ((*buf = malloc(size)) == NULL) {
+		close(fd);
+		return -1;
+	}
+	while ((n = read(fd, *buf + len, size - len)) > 0) {
+		len += n;
+		if (len == size) {
+			if ((bigger = realloc(*buf, size * 2)) == NULL) {
+				n = -1;
+				break;
+			}
+			*buf  = bigger;
+			size *= 2;
+		}
+	}
+	close(fd);
+	if (n < 0) {
+		free(*buf);
+		*buf = NULL;
+		return -1;
+	}
+	return (ssize_t)len;
+}
+
+/*
+ * Function to find the holders and waiters of a set of files
+ * Returns 0 if /proc/locks could not be read
+ */
+int scan_proc_locks(struct lock_target *targets, int n_targets) {
+	struct lock_target **table;
+	struct lock_target  *t;
+	struct proc_lock     lock;
+	struct stat          st;
+	char                *buf,
+	                     rw[8];
+	const char          *p,
+	                    *line,
+	                    *end,
+	                    *eol;
+	long long            pid,
+	                     major,
+	                     minor,
+	                     ino;
+	size_t               mask = 1,
+	                     slot;
+	ssize_t              len;
+	int                  i;
+
+	/*
+	 * Hash the targets by inode, at most half full
+	 */
+	while (mask < (size_t)n_targets * 2)
+		mask <<= 1;
+	if ((table = calloc(mask, sizeof(*table))) == NULL) {
+		printf("Failed to read %s: %s\n", PROC_LOCKS, strerror(errno));
+		return 0;
+	}
+	mask -= 1;
+
+	for (i = 0; i < n_targets; i++) {
+		t = &targets[i];
+		if (stat(t->path, &st) < 0)
+			continue;
+		t->exists = 1;
+		t->dev    = st.st_dev;
+		t->ino    = st.st_ino;
+		for (slot = t->ino & mask; table[slot]; slot = (slot + 1) & mask)
+			;
+		table[slot] = t;
+	}
+
+	if ((len = read_proc_locks(&buf)) < 0) {
+		printf("Failed to read %s: %s\n", PROC_LOCKS, strerror(errno));
+		free(table);
+		return 0;
+	}
+
+	for (line = buf, end = buf + len; line < end; line = eol + 1) {
+		if ((eol = memchr(line, '\n', end - line)) == NULL)
+			eol = end;
+
+		memset(&lock, 0, sizeof(lock));
+		if ((p = memchr(line, ':', eol - line)) == NULL)
+			continue;
+		p++;
+		while (p < eol && *p == ' ')
+			p++;
+		if (eol - p > 2 && p[0] == '-' && p[1] == '>') {
+			lock.waiter = 1;
+			p += 2;
+		}
+		p = proc_field(p, eol, lock.type, sizeof(lock.type));
+		p = proc_field(p, eol, rw, sizeof(rw));       /* ADVISORY */
+		p = proc_field(p, eol, rw, sizeof(rw));
+		p = proc_number(p, eol, 10, &pid);
+		p = proc_number(p, eol, 16, &major);
+		if (p >= eol || *p++ != ':')
+			continue;
+		p = proc_number(p, eol, 16, &minor);
+		if (p >= eol || *p++ != ':')
+			continue;
+		proc_number(p, eol, 10, &ino);
+
+		for (slot = (ino_t)ino & mask; (t = table[slot]) != NULL; slot = (slot + 1) & mask) {
+			if (t->ino == (ino_t)ino && major(t->dev) == major && minor(t->dev) == minor) {
+				lock.pid   = (int)pid;
+				lock.write = (strcmp(rw, "WRITE") == 0);
+				if (!add_proc_lock(t, &lock)) {
+					printf("Failed to read %s: %s\n", PROC_LOCKS, strerror(errno));
+					free(buf);
+					free(table);
+					return 0;
+				}
+			}
+		}
+	}
+
+	free(buf);
+	free(table);
+	return 1;
+}
+
+void free_lock_targets(struct lock_target *targets, int n_targets) {
+	int i;
+
+	for (i = 0; i < n_targets; i++)
+		free(targets[i].locks);
+	free(targets);
+}
+
+/*
+ * Function to set up the request for one of several paths asked about
+ * Returns 1 if its lock is one the kernel lists in /proc/locks, or 0
+ * if its backend has to be asked instead
+ */
+int query_request(struct lock_request *query, struct lock_request *req, int auto_backend, const char *path) {
+	const char *fs_name;
+
+	*query          = *req;
+	query->fd       = 0;
+	query->filename = path;
+	if (req->tree_dir)
+		query->type = TREE;
+	else if (auto_backend)
+		query->type = auto_type(query, &fs_name);
+	return !fileless(query) && query->type != DOTLOCK;
+}
+
+/*
+ * Function to find the holder of a lock its backend keeps to itself
+ * Returns the PID, 0 if nobody holds it, -1 on error
+ */
+int backend_holder(struct lock_request *query) {
+	return (query->type == DOTLOCK) ? dotlock_holder(query) : fileless_holder(query);
+}
+
+/*
+ * Function to report who holds and who is waiting for each file
+ * Only kernel locks have waiters to show.
+ */
+int print_who(struct lock_request *req, int auto_backend, char **paths, int n_paths) {
+	struct lock_request query;
+	struct lock_target *targets,
+	                   *t;
+	struct proc_lock   *l;
+	int                 i,
+	                    j,
+	                    pid;
+
+	if ((targets = calloc(n_paths, sizeof(*targets))) == NULL) {
+		printf("Failed to query locks: %s\n", strerror(errno));
+		return 1;
+	}
+	for (i = 0; i < n_paths; i++)
+		targets[i].path = paths[i];
+
+	if (!scan_proc_locks(targets, n_paths)) {
+		free_lock_targets(targets, n_paths);
+		return 1;
+	}
+
+	for (i = 0; i < n_paths; i++) {
+		t = &targets[i];
+		if (!query_request(&query, req, auto_backend, t->path)) {
+			if ((pid = backend_holder(&query)) < 0)
+				printf("%s: %s\n", t->path, strerror(errno));
+			else if (pid == 0)
+				printf("%s: unlocked\n", t->path);
+			else
+				printf("%s: locked\n  %-6s %8i %-6s %s\n", t->path, "holder", pid, type_names[query.type], "WRITE");
+			continue;
+		}
+		if (!t->exists) {
+			printf("%s: does not exist\n", t->path);
+			continue;
+		}
+		printf("%s: %s\n", t->path, t->n_holders ? "locked" : "unlocked");
+		for (j = 0; j < t->n_locks; j++) {
+			l = &t->locks[j];
+			printf("  %-6s %8i %-6s %s\n", l->waiter ? "waiter" : "holder", l->pid, l->type, l->write ? "WRITE" : "READ");
+		}
+	}
+
+	free_lock_targets(targets, n_paths);
+	return 0;
+}
+
+/*
+ * Function to test many files for locks in one scan
+ * Paths come from the arguments, or one per line on stdin if there
+ * are none (or just "-"). Prints one tab separated line per path:
+ *
+ *   locked    1234,5678  path
+ *   unlocked  -          path
+ *   missing   -          path
+ *
+ * Locks that aren't in /proc/locks are asked about one at a time, and
+ * show as "error" if their backend can't be asked.
+ * Exits 1 if any of the files is locked, like test(1) would.
+ */
+int test_files(struct lock_request *req, int auto_backend, char **paths, int n_paths) {
+	struct lock_request query;
+	struct lock_target *targets     = NULL,
+	                   *t;
+	char              **stdin_paths = NULL,
+	                  **more_paths,
+	                   *line        = NULL;
+	const char         *sep;
+	size_t              line_len    = 0;
+	ssize_t             len;
+	int                 i,
+	                    j,
+	                    pid,
+	                    max_paths   = 0,
+	                    n_stdin     = 0,
+	                    retval      = 0;
+
+	if (n_paths == 0 || (n_paths == 1 && strcmp(paths[0], "-") == 0)) {
+		while ((len = getline(&line, &line_len, stdin)) > 0) {
+			if (line[len - 1] == '\n')
+				line[--len] = '\0';
+			if (len == 0)
+				continue;
+			if (n_stdin == max_paths) {
+				max_paths = max_paths ? max_paths * 2 : 256;
+				if ((more_paths = realloc(stdin_paths, max_paths * sizeof(*stdin_paths))) == NULL) {
+					printf("Failed to read paths: %s\n", strerror(errno));
+					free(line);
+					n_paths = 0;
+					retval  = 1;
+					goto out;
+				}
+				stdin_paths = more_paths;
+			}
+			if ((stdin_paths[n_stdin] = strdup(line)) != NULL)
+				n_stdin++;
+		}
+		free(line);
+		paths   = stdin_paths;
+		n_paths = n_stdin;
+	}
+
+	if ((targets = calloc(n_paths ? n_paths : 1, sizeof(*targets))) == NULL) {
+		printf("Failed to test locks: %s\n", strerror(errno));
+		n_paths = 0;
+		retval  = 1;
+		goto out;
+	}
+	for (i = 0; i < n_paths; i++)
+		targets[i].path = paths[i];
+
+	if (!scan_proc_locks(targets, n_paths)) {
+		retval = 1;
+		goto out;
+	}
+
+	for (i = 0; i < n_paths; i++) {
+		t = &targets[i];
+		if (!query_request(&query, req, auto_backend, t->path)) {
+			if ((pid = backend_holder(&query)) < 0) {
+				retval = 1;
+				printf("error\t-\t%s\n", t->path);
+			}
+			else if (pid == 0)
+				printf("unlocked\t-\t%s\n", t->path);
+			else {
+				retval = 1;
+				printf("locked\t%i\t%s\n", pid, t->path);
+			}
+			continue;
+		}
+		if (!t->exists) {
+			printf("missing\t-\t%s\n", t->path);
+			continue;
+		}
+		if (t->n_holders == 0) {
+			printf("unlocked\t-\t%s\n", t->path);
+			continue;
+		}
+
+		retval = 1;
+		printf("locked\t");
+		for (j = 0, sep = ""; j < t->n_locks; j++) {
+			if (!t->locks[j].waiter) {
+				printf("%s%i", sep, t->locks[j].pid);
+				sep = ",";
+			}
+		}
+		printf("\t%s\n", t->path);
+	}
+
+out:
+	if (targets)
+		free_lock_targets(targets, n_paths);
+	for (i = 0; i < n_stdin; i++)
+		free(stdin_paths[i]);
+	free(stdin_paths);
+	return retval;
+}
+
+/*
+ * Live view of the hottest locks, most contended first
+ */
+struct top_entry {
+	struct lock_stats snap;
+	int               waiters;
+	double            rate;
+	uint64_t          p99;
+};
+
+int compare_top(const void *a, const void *b) {
+	const struct top_entry *x = *(const struct top_entry **)a,
+	                       *y = *(const struct top_entry **)b;
+
+	if (x->waiters != y->waiters)
+		return y->waiters - x->waiters;
+	if (x->p99 != y->p99)
+		return (y->p99 > x->p99) ? 1 : -1;
+	return (y->rate > x->rate) - (y->rate < x->rate);
+}
+
+int print_top(void) {
+	static struct top_entry  entries[STATS_MAX_LOCKS];
+	static struct top_entry *order[STATS_MAX_LOCKS];
+	static uint64_t          prev_acquires[STATS_MAX_LOCKS];
+	struct stats_table      *table;
+	struct top_entry        *e;
+	uint64_t                 now,
+	                         last = 0;
+	double                   dt;
+	int                      i,
+	                         n;
+
+	if ((table = stats_open()) == NULL) {
+		printf("Failed to open statistics: %s\n", strerror(errno));
+		return 1;
+	}
+
+	for (;;) {
+		now = now_ns();
+		dt  = last ? (now - last) / 1e9 : 0;
+		n   = 0;
+
+		for (i = 0; i < STATS_MAX_LOCKS; i++) {
+			if (__atomic_load_n(&table->locks[i].key, __ATOMIC_ACQUIRE) == 0)
+				continue;
+
+			e = &entries[i];
+			stats_snapshot(&table->locks[i], &e->snap);
+			e->waiters = stats_waiters(&table->locks[i]);
+			e->p99 = hist_percentile(e->snap.wait_hist, 0.99);
+			/*
+			 * Smooth the acquire rate over roughly a second
+			 */
+			if (dt > 0)
+				e->rate = 0.9 * e->rate + 0.1 * (e->snap.acquires - prev_acquires[i]) / dt;
+			prev_acquires[i] = e->snap.acquires;
+			order[n++] = e;
+		}
+		last = now;
+
+		qsort(order, n, sizeof(order[0]), compare_top);
+
+		printf("\033[H\033[2J");
+		printf("%7s %8s %10s %9s %11s  %s\n", "WAITERS", "HOLDER", "HELD(s)", "ACQ/s", "P99WAIT(ms)", "LOCK");
+		for (i = 0; i < n && i < TOP_MAX_ROWS; i++) {
+			e = order[i];
+			if (e->snap.holder && (kill(e->snap.holder, 0) == 0 || errno == EPERM))
+				printf("%7i %8i %10.1f", e->waiters, e->snap.holder, (now - e->snap.held_since_ns) / 1e9);
+			else
+				printf("%7i %8s %10s", e->waiters, "-", "-");
+			printf(" %9.1f %11.3f  %s\n", e->rate, e->p99 / 1e3, e->snap.path);
+		}
+		fflush(stdout);
+
+		usleep(TOP_INTERVAL_US);
+	}
+	return 0;
+}
+
+/*
+ * Garbage collection functions
+ *
+ * Holders never remove their lock files, so `flock --gc DIR` sweeps DIR
+ * and everything below it, removing lock files that nobody holds. Each
+ * file is locked without blocking - with both flock and fcntl, so that
+ * holders of either kind are seen - and only unlinked while it is still
+ * the file at its path. Acquirers make the same check once they have
+ * their lock (see relock_removed()), so nobody is ever left holding a
+ * lock on a file that has been removed. Fencing tokens on a new file
+ * start from the clock, so they keep increasing across removals.
+ *
+ * --gc-rate limits how many files are looked at per second, so that
+ * sweeping millions of files doesn't swamp the disk.
+ */
+struct gc_state {
+	uint64_t start_ns;
+	long     rate;
+	long     checked;
+	long     removed;
+};
+
+/*
+ * Function to remove one lock file if nobody holds it
+ * Only files that are empty or start with an owner record are touched.
+ * Files with a dotlock are left alone, and gc takes the dotlock itself
+ * while it removes a file, so a dotlock holder can't get in between
+ * the check and the unlink - one that opened the file before then
+ * finds it gone once it has the dotlock, and opens the new one.
+ */
+int gc_file(const char *path) {
+	struct lock_request dot = {0};
+	char                dotlock[PATH_MAX];
+	struct stat         fd_st,
+	                    path_st;
+	int                 fd,
+	                    pid,
+	                    removed = 0;
+
+	dotlock_path(path, dotlock);
+	if (access(dotlock, F_OK) == 0 || (fd = open(path, O_RDWR | O_NOFOLLOW)) < 0)
+		return 0;
+
+	if (fstat(fd, &fd_st) == 0 && S_ISREG(fd_st.st_mode) &&
+	    (fd_st.st_size == 0 || read_pid(fd) > 0) &&
+	    flock(fd, LOCK_EX | LOCK_NB) == 0 && lockf(fd, F_TLOCK, 0) == 0 &&
+	    dotlock_create(&dot, dotlock) > 0) {
+		if (stat(path, &path_st) == 0 && fd_st.st_dev == path_st.st_dev && fd_st.st_ino == path_st.st_ino)
+			removed = (unlink(path) == 0);
+		dotlock_remove(dotlock, 0, 1, &pid);
+	}
+
+	close(fd);
+	return removed;
+}
+
+/*
+ * Function to sweep a directory and its subdirectories
+ * Dotlocks and their temporary files are skipped - they are removed by
+ * their holders, or broken as stale.
+ */
+void gc_dir(const char *dir, struct gc_state *gc) {
+	char           path[PATH_MAX];
+	DIR           *d;
+	struct dirent *ent;
+	struct stat    st;
+	uint64_t       due,
+	               now;
+	int            type;
+
+	if ((d = opendir(dir)) == NULL) {
+		printf("Failed to open directory %s: %s\n", dir, strerror(errno));
+		return;
+	}
+
+	while ((ent = readdir(d)) != NULL) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+			continue;
+		if (snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name) >= (int)sizeof(path))
+			continue;
+
+		type = ent->d_type;
+		if (type == DT_UNKNOWN && lstat(path, &st) == 0)
+			type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+		if (type == DT_DIR) {
+			gc_dir(path, gc);
+			continue;
+		}
+		if (type != DT_REG || strstr(ent->d_name, ".lock") != NULL)
+			continue;
+
+		gc->removed += gc_file(path);
+		gc->checked++;
+
+		if (gc->rate) {
+			due = gc->start_ns + gc->checked * 1000000000ULL / gc->rate;
+			if (due > (now = now_ns()))
+				usleep((due - now) / 1000);
+		}
+	}
+	closedir(d);
+}
+
+int gc_locks(const char *dir, long rate) {
+	struct gc_state gc = {0};
+
+	gc.start_ns = now_ns();
+	gc.rate     = rate;
+	gc_dir(dir, &gc);
+	printf("Removed %ld of %ld lock files from %s\n", gc.removed, gc.checked, dir);
+	return 0;
+}
+
+/*
+ * Child process functions
+ */
+
+/*
+ * Tell the parent how the lock attempt went.
+ * In async mode the parent has already exited with a ticket,
+ * so there is nobody to tell.
+ */
+void notify_parent(struct lock_request *req, int ppid, int sig) {
+	if (!req->async)
+		kill(ppid, sig);
+}
+ 
+/*
+ * Check that a PID read from a lock really holds it, rather than being
+ * left behind in the file and since given to some other process
+ */
+int holds_lock(struct lock_request *req, int pid) {
+	struct lock_target target = {0};
+	int                i,
+	                   held = 0;
+
+	if (req->type == SYSV)
+		return sysv_holder(req->filename, pid) == pid;
+	if (fileless(req))
+		return fileless_holder(req) == pid;
+	if (req->type == DOTLOCK)
+		return dotlock_holder(req) == pid;
+
+	target.path = req->filename;
+	if (!scan_proc_locks(&target, 1))
+		return 0;
+	for (i = 0; i < target.n_locks; i++) {
+		if (!target.locks[i].waiter && target.locks[i].pid == pid)
+			held = 1;
+	}
+	free(target.locks);
+	return held;
+}
+
+/*
+ * Check that a PID belongs to a process running this program
+ */
+int flock_binary(int pid) {
+	char    path[64],
+	        exe[PATH_MAX],
+	        self[PATH_MAX];
+	ssize_t len;
+
+	snprintf(path, sizeof(path), "/proc/%i/exe", pid);
+	if ((len = readlink(path, exe, sizeof(exe) - 1)) < 0)
+		return 0;
+	exe[len] = '\0';
+	if ((len = readlink("/proc/self/exe", self, sizeof(self) - 1)) < 0)
+		return 0;
+	self[len] = '\0';
+	return strcmp(exe, self) == 0;
+}
+
+/*
+ * Let the current holder know someone is about to queue behind it
+ * Only signal the PID in the statistics slot if it really holds the
+ * lock right now - a holder that has let go, or a stale PID reused by
+ * some other process, is left alone.
+ */
+void notify_holder(struct lock_request *req) {
+	int holder,
+	    current;
+
+	if (req->no_block || req->stats == NULL)
+		return;
+	holder = __atomic_load_n(&req->stats->holder, __ATOMIC_RELAXED);
+	if (holder == 0 || holder == getpid())
+		return;
+
+	/*
+	 * For kernel locks, asking /proc/locks would mean reading every
+	 * lock on the system on every blocking request. The owner record
+	 * has to name the same PID instead, and it has to still be a flock
+	 * process - a holder killed outright leaves both behind.
+	 */
+	if (fileless(req) || req->type == DOTLOCK)
+		current = holds_lock(req, holder);
+	else
+		current = (req->n_ranges ? range_holder(req->fd, req) : read_pid(req->fd)) == holder &&
+		          flock_binary(holder);
+	if (current)
+		kill(holder, CONTENDED);
+}
+
+/*
+ * Function to open a lock file, creating it if needed
+ * Namespaced lock files get their directories created the first time.
+ */
+int open_lock_file(struct lock_request *req) {
+	int fd;
+
+	if ((fd = open(req->filename, O_CREAT | O_RDWR, 0700)) < 0 && errno == ENOENT &&
+	    req->sharded && make_parents(req->filename))
+		fd = open(req->filename, O_CREAT | O_RDWR, 0700);
+	return fd;
+}
+
+/*
+ * Function to make sure a lock is on the file that is at its path
+ * --gc can remove the file between our open and our lock, which would
+ * leave us holding a lock nobody else can see - if so, lock the new
+ * file instead. A dotlock is kept in its own file so only needs the
+ * new file opening.
+ */
+int relock_removed(struct lock_request *req) {
+	struct stat fd_st,
+	            path_st;
+
+	if (fileless(req))
+		return 1;
+
+	while (fstat(req->fd, &fd_st) < 0 || fd_st.st_nlink == 0 ||
+	       stat(req->filename, &path_st) < 0 ||
+	       fd_st.st_dev != path_st.st_dev || fd_st.st_ino != path_st.st_ino) {
+		close(req->fd);
+		if ((req->fd = open_lock_file(req)) < 0 ||
+		    (req->type != DOTLOCK && !lock_descriptor(req)))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Open and lock req->filename, then write our PID to it
+ * Returns 1 on success, 0 on failure with req->fd closed
+ */
+int acquire_file(struct lock_request *req) {
+	struct owner_record prev;
+	int                 turn;
+
+	/*
+	 * Open file - the abstract and sysv backends have no file
+	 */
+	errno = 0;
+	if (fileless(req))
+		req->fd = -1;
+	else if ((req->fd = open_lock_file(req)) < 0) {
+		printf("Failed to open file %s: %s\n", req->filename, strerror(errno));
+		if ((req->stats = stats_lookup(req->filename)) != NULL)
+			stats_add(&req->stats->failures, 1);
+		trace_record(TRACE_FAIL, req->filename, getpid(), now_ns());
+		return 0;
+	}
+	
+	/*
+	 * Lock file
+	 */
+	printf("Locking file %s\n", req->filename);
+	req->stats = stats_lookup(req->filename);
+	stats_waiting(req);
+	notify_holder(req);
+	if ((turn = deadline_wait(req)) < 0) {
+		printf("Missed deadline for file %s\n", req->filename);
+		trace_record(TRACE_TIMEOUT, req->filename, getpid(), now_ns());
+		stats_done_waiting();
+		if (req->stats)
+			stats_add(&req->stats->timeouts, 1);
+		if (req->fd >= 0)
+			close(req->fd);
+		return 0;
+	}
+	if ((!turn && !lock_descriptor(req)) || !relock_removed(req)) {
+		trace_record(TRACE_FAIL, req->filename, getpid(), now_ns());
+		stats_done_waiting();
+		if (req->stats)
+			stats_add(req->no_block ? &req->stats->busy : &req->stats->failures, 1);
+		if (req->fd >= 0)
+			close(req->fd);
+		return 0;
+	}
+	stats_acquired(req);
+	trace_record(TRACE_ACQUIRE, req->filename, getpid(), req->acquired_ns);
+	lockdep_update(req, req->filename, 1);
+	
+	if (fileless(req)) {
+		printf("Locked %s\n", req->filename);
+		return 1;
+	}
+	if (req->n_ranges) {
+		printf("Locked %i range%s of file %s\n", req->n_ranges, (req->n_ranges == 1) ? "" : "s", req->filename);
+		return 1;
+	}
+	
+	/*
+	 * File is locked - write our PID to it
+	 *
+	 * Every acquisition also takes the next fencing token. Holding
+	 * the lock makes the read-increment-write atomic with respect to
+	 * every other holder of this file.
+	 */
+	read_owner_record(req->fd, &prev);
+	req->token = prev.token ? prev.token + 1 : realtime_ns() / 1000;
+	if (req->ttl)
+		req->expires = time(NULL) + req->ttl;
+	write_owner_record(req);
+	printf("Locked file %s with fencing token %llu\n", req->filename, req->token);
+
+	return 1;
+}
+
+/*
+ * Function to let go of a lock while carrying on running
+ * Locks tied to the descriptor go when it is closed; the others have
+ * to be undone by hand.
+ */
+void release_lock(struct lock_request *req) {
+	if (req->type == DOTLOCK)
+		dotlock_release(req->filename);
+	else if (req->type == TREE)
+		tree_release(req);
+	else if (req->type == SYSV)
+		sysv_release(req);
+	if (req->fd >= 0)
+		close(req->fd);
+	req->fd = -1;
+}
+
+/*
+ * Keep the statistics and trace right however the child exits
+ */
+void child_exit(void) {
+	if (held_req) {
+		PROBE4(holder__exit, held_req->filename, type_names[held_req->type], now_ns() - held_req->acquired_ns, held_req->fd);
+		trace_record(TRACE_RELEASE, held_req->filename, getpid(), now_ns());
+		release_lock(held_req);
+		lockdep_update(held_req, held_req->filename, 0);
 	}
-	
-	return retval;
+	stats_exit();
 }
 
 /*
- * Function to unlock an open file descriptor
- * The file descriptor will have been passed to us by the user.
- #
- * This function will only be used if the file lock operation
- * was given a file descriptor by the user AND the lock type was
- * flock.
+ * Move the held cursor one step along the chain of lock files.
+ * The next lock is taken before the current one is released so
+ * nobody else can get in between the two stages. Advancing past
+ * the end of the chain releases the last lock.
  */
-int unlock_descriptor(int fd) {
-	int retval = 1;
+void advance_chain(struct lock_request *req) {
+	struct lock_request prev      = *req,
+	                    next      = *req;
+	int                 requester = advance_pid;
+	sigset_t            mask,
+	                    old_mask;
+
+	advance_pid = 0;
+
+	if (req->chain_pos + 1 >= req->chain_len) {
+		printf("End of chain - unlocking\n");
+		/*
+		 * Let go before answering, so that the requester can't
+		 * carry on while we still hold the last stage
+		 */
+		child_exit();
+		held_req = NULL;
+		kill(requester, CHILD_OK);
+		exit(0);
+	}
+
 	/*
-	 * Only need to handle flock lock type
+	 * Take the next stage on a copy, so that an unlock arriving while
+	 * we wait for it still lets go of the stage we hold
 	 */
-	errno = 0;
-	if (flock(fd, LOCK_UN) == -1) {
-		printf("Failed to unlock file (fd = %i): %s\n", fd, strerror(errno));
-		retval = 0;
-	}
-	else {
-		printf("Unlocked file descriptor %i\n", fd);
+	next.filename     = req->chain[req->chain_pos + 1];
+	next.requested_ns = now_ns();
+	trace_record(TRACE_REQUEST, next.filename, getpid(), next.requested_ns);
+
+	/*
+	 * An unlock exits from its signal handler, which mustn't happen
+	 * in the middle of the allocations made by the order check
+	 */
+	sigemptyset(&mask);
+	sigaddset(&mask, PARENT_TO);
+	sigaddset(&mask, UNLOCK);
+	sigprocmask(SIG_BLOCK, &mask, &old_mask);
+	lockdep_check(&next);
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (!acquire_file(&next)) {
+		kill(requester, CHILD_FAIL);
+		return;
 	}
-	return retval;
+
+	sigprocmask(SIG_BLOCK, &mask, &old_mask);
+	*req = next;
+	req->chain_pos++;
+	release_lock(&prev);
+	lockdep_update(req, prev.filename, 0);
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	stats_released(prev.stats, prev.acquired_ns);
+	trace_record(TRACE_RELEASE, prev.filename, getpid(), now_ns());
+	printf("Advanced from %s to %s\n", prev.filename, req->filename);
+	kill(requester, CHILD_OK);
+}
+
+void advance_sig_handler(int sig, siginfo_t *info, void *ctx) {
+	advance_pid = info->si_pid;
+}
+
+void renew_sig_handler(int sig) {
+	renew_requested = 1;
+}
+
+void contended_sig_handler(int sig) {
+	contention = 1;
 }
 
 /*
- * Child process functions
+ * Push the lease expiry back by another ttl seconds
  */
- 
+void renew_lease(struct lock_request *req, int timer_fd) {
+	struct itimerspec its = {0};
+
+	its.it_value.tv_sec = req->ttl;
+	timerfd_settime(timer_fd, 0, &its, NULL);
+
+	/*
+	 * Like acquire_file(), leave ranged data files and the sockets of
+	 * fileless locks alone - they have no owner record
+	 */
+	req->expires = time(NULL) + req->ttl;
+	if (!req->n_ranges && !fileless(req))
+		write_owner_record(req);
+}
+
 int child_loop(struct lock_request *req, int ppid, int script_pid) {
-	int  pid = getpid();
-	char pid_str[MAX_PID_LEN+1] = {0};
-	
+	struct sigaction sa = {0};
+	struct pollfd    fds[3];
+	int              nfds          = 0,
+	                 timer_idx     = -1,
+	                 heartbeat_idx = -1,
+	                 socket_idx    = -1,
+	                 timer_fd      = -1,
+	                 chain_pos,
+	                 conn;
+	char             buf[64];
+
 	/*
 	 * Set the child flag to let the signal handler know
 	 * which process is running
 	 */
 	child = 1;
-		
+
 	/*
-	 * Open file
+	 * ADVANCE only sets a flag - the work is done from the loop below
 	 */
-	errno = 0;
-	if ((req->fd = open(req->filename, O_CREAT | O_RDWR, 0700)) < 0) {
-		printf("Failed to open file %s: %s\n", req->filename, strerror(errno));
-		kill(ppid, SIGUSR2);
-		return 1;
-	}
-	
+	sa.sa_sigaction = advance_sig_handler;
+	sa.sa_flags     = SA_SIGINFO | SA_RESTART;
+	sigaction(ADVANCE, &sa, NULL);
+	signal(RENEW, renew_sig_handler);
+	signal(CONTENDED, contended_sig_handler);
+	if (req->contention_fd > 0)
+		fcntl(req->contention_fd, F_SETFL, fcntl(req->contention_fd, F_GETFL) | O_NONBLOCK);
+
+	if (req->chain)
+		req->filename = req->chain[0];
+	req->script_pid = script_pid;
+
 	/*
-	 * Lock file
+	 * Keep the waiter and holder statistics right however we exit
 	 */
-	printf("Locking file %s\n", req->filename);
-	if (!lock_descriptor(req)) {
-		kill(ppid, SIGUSR2);
+	atexit(child_exit);
+
+	if (!acquire_file(req)) {
+		notify_parent(req, ppid, CHILD_FAIL);
 		return 1;
 	}
 	
 	/*
-	 * File is locked - write our PID to it
+	 * Record the hold time however we end up exiting
 	 */
-	snprintf(pid_str, MAX_PID_LEN, "%i", pid);
-	lseek(req->fd, 0, SEEK_SET);
-	ftruncate(req->fd, 0);
-	write(req->fd, pid_str, strlen(pid_str));
+	held_req = req;
 	
 	/*
 	 * Now send a signal to tell the parent process we have locked the file
 	 */
-	kill(ppid, SIGUSR1);
+	notify_parent(req, ppid, CHILD_OK);
 	
 	/*
 	 * We've locked the file and told the parent to exit.
@@ -133,14 +3984,102 @@ int child_loop(struct lock_request *req, int ppid, int script_pid) {
 	 * calling script has exited without calling unlock!
 	 *
 	 * Check for the script pid using the null signal.
+	 *
+	 * With a lease, also give up the lock when the timer fires
+	 * before anyone renews it. Each read from the heartbeat fd
+	 * counts as a renewal.
 	 */
+	if (req->ttl) {
+		timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+		renew_lease(req, timer_fd);
+		timer_idx          = nfds;
+		fds[nfds].fd       = timer_fd;
+		fds[nfds++].events = POLLIN;
+		if (req->heartbeat_fd > 0) {
+			heartbeat_idx      = nfds;
+			fds[nfds].fd       = req->heartbeat_fd;
+			fds[nfds++].events = POLLIN;
+		}
+	}
+
+	/*
+	 * An abstract socket or semaphore slot holder accepts and drops
+	 * connections from anyone looking up its PID, so the backlog never
+	 * fills up, and tells them which script it holds the lock for
+	 */
+	if (req->type == ABSTRACT || req->type == SYSV) {
+		socket_idx         = nfds;
+		fds[nfds++].events = POLLIN;
+	}
+
 	while(kill(script_pid, 0) == 0) {
-		sleep(1);
+		if (socket_idx >= 0)
+			fds[socket_idx].fd = req->fd;
+
+		if (advance_pid) {
+			/*
+			 * Each stage gets a lease of its own
+			 */
+			chain_pos = req->chain_pos;
+			advance_chain(req);
+			if (req->ttl && req->chain_pos != chain_pos)
+				renew_lease(req, timer_fd);
+			continue;
+		}
+		if (renew_requested) {
+			renew_requested = 0;
+			if (req->ttl)
+				renew_lease(req, timer_fd);
+		}
+		if (contention) {
+			/*
+			 * Make the script's contention fd readable
+			 */
+			contention = 0;
+			if (req->contention_fd > 0)
+				write(req->contention_fd, "!", 1);
+		}
+
+		/*
+		 * A dotlock can be taken from us by someone breaking it as
+		 * stale - then we no longer hold it, however long the script
+		 * thinks it has
+		 */
+		if (req->type == DOTLOCK && !dotlock_mine(req)) {
+			printf("Lost lock on %s\n", req->filename);
+			if (req->expire_sig)
+				kill(script_pid, req->expire_sig);
+			return 1;
+		}
+
+		if (poll(fds, nfds, 1000) <= 0)
+			continue;
+
+		if (timer_idx >= 0 && (fds[timer_idx].revents & POLLIN)) {
+			printf("Lease on %s expired\n", req->filename);
+			if (req->expire_sig)
+				kill(script_pid, req->expire_sig);
+			return 1;
+		}
+		if (heartbeat_idx >= 0 && fds[heartbeat_idx].revents) {
+			if (read(req->heartbeat_fd, buf, sizeof(buf)) > 0)
+				renew_lease(req, timer_fd);
+			else
+				fds[heartbeat_idx].fd = -1;
+		}
+		if (socket_idx >= 0 && (fds[socket_idx].revents & POLLIN)) {
+			if ((conn = accept4(req->fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+				send(conn, &script_pid, sizeof(script_pid), MSG_DONTWAIT | MSG_NOSIGNAL);
+				close(conn);
+			}
+		}
 	}
 	
 	/*
 	 * Calling script must have exited
 	 */
+	if (req->stats)
+		stats_add(&req->stats->stale, 1);
 
 	return 1;
 }
@@ -152,6 +4091,7 @@ void child_sig_handler(int sig) {
 	switch(sig) {
 		case PARENT_TO:
 			printf("Parent process signalled timeout - exiting\n");
+			PROBE4(timeout, active_req->filename, type_names[active_req->type], now_ns() - active_req->requested_ns, active_req->fd);
 			exit(1);
 			break;
 		case UNLOCK:
@@ -168,14 +4108,14 @@ void child_sig_handler(int sig) {
  * Parent process functions
  */
 
-int parent_loop(int cpid, int timeout) {
+int parent_loop(struct lock_request *req, int cpid) {
 	int time = 0;
 
 	/*
 	 * All the parent process needs to do now is wait
 	 * for either the USR1 signal or the timeout
 	 */
-	while (timeout == 0 || time++ < timeout) {
+	while (req->timeout == 0 || time++ < req->timeout) {
 		sleep(1);
 	}
 	
@@ -184,7 +4124,19 @@ int parent_loop(int cpid, int timeout) {
 	 * to signals so must have timed out.
 	 */
 	kill(cpid, SIGUSR1);
+	PROBE4(timeout, req->filename, type_names[req->type], now_ns() - req->requested_ns, cpid);
+	if ((req->stats = stats_lookup(req->filename)) != NULL)
+		stats_add(&req->stats->timeouts, 1);
+	trace_record(TRACE_TIMEOUT, req->filename, cpid, now_ns());
 	
+	/*
+	 * The timeout of a request with a deadline is the deadline, and
+	 * missing it is a failure
+	 */
+	if (req->deadline_ns) {
+		printf("Missed deadline for file %s\n", req->filename);
+		return 1;
+	}
 	return 0;
 }
 
@@ -196,10 +4148,14 @@ void parent_sig_handler(int sig) {
 	switch(sig) {
 		case CHILD_OK:
 			printf("Child has successfully locked file - exiting\n");
+			if (active_req)
+				PROBE4(request__done, active_req->filename, type_names[active_req->type], now_ns() - active_req->requested_ns, 1);
 			exit(0);
 			break;
 		case CHILD_FAIL:
 			printf("Child process failed to lock file\n");
+			if (active_req)
+				PROBE4(request__done, active_req->filename, type_names[active_req->type], now_ns() - active_req->requested_ns, 0);
 			exit(1);
 			break;
 		default:
@@ -224,36 +4180,45 @@ void sig_handler(int sig) {
 int unlock_file(struct lock_request *req) {
 	int   fd,
 	      locked,
-	      pid  = 0,
+	      pid,
 	      time = 0;
-	char  pid_str[MAX_PID_LEN+1] = {0},
-	     *end;
 
 	/*
-	 * Open the file and check that it is locked
-	 */
-	errno = 0;
-	if ((fd = open(req->filename, O_RDONLY)) < 0) {
-		printf("Failed to open file %s: %s\n", req->filename, strerror(errno));
-		return 1;
-	}
-	
-	errno = 0;
-	if ((locked = lockf(fd, F_TEST, 0)) == 0) {
-		printf("File %s was not locked\n", req->filename);
-	}
-	
-	/*
-	 * Now read the PID from that file
+	 * A lock with no file - ask the socket or semaphore who holds it
 	 */
-	if (read(fd, pid_str, MAX_PID_LEN) > 0) {
-		pid = (int)strtol(pid_str, &end, 10);
-		if (*end != '\0' && *end != '\n')
-			pid = 0;
+	if (fileless(req)) {
+		fd     = -1;
+		locked = -1;
+		if ((pid = read_holder(req)) == 0)
+			return 1;
 	}
-	if (pid == 0) {
-		printf("Failed to read pid from file %s\n", req->filename);
-		return 1;
+	else {
+		/*
+		 * Open the file and check that it is locked
+		 */
+		errno = 0;
+		if ((fd = open(req->filename, O_RDONLY)) < 0) {
+			printf("Failed to open file %s: %s\n", req->filename, strerror(errno));
+			return 1;
+		}
+		
+		errno = 0;
+		if (req->type == DOTLOCK)
+			locked = dotlock_holder(req) != 0;
+		else
+			locked = lockf(fd, F_TEST, 0);
+		if (locked == 0) {
+			printf("File %s was not locked\n", req->filename);
+		}
+		
+		/*
+		 * Now read the PID from that file, or ask the kernel
+		 * who holds the ranges
+		 */
+		if ((pid = req->n_ranges ? range_holder(fd, req) : read_pid(fd)) == 0) {
+			printf("Failed to read pid from file %s\n", req->filename);
+			return 1;
+		}
 	}
 	
 	if (req->no_block)
@@ -267,6 +4232,10 @@ int unlock_file(struct lock_request *req) {
 				printf("Failed to send signal to child process %i: %s\n", pid, strerror(errno));
 			break;
 		}
+		if (time == 1) {
+			PROBE4(unlock__requested, req->filename, type_names[req->type], pid, fd);
+			trace_record(TRACE_UNLOCK, req->filename, pid, now_ns());
+		}
 		
 		/*
 		 * If file was unlocked, send a signal to child process
@@ -279,13 +4248,387 @@ int unlock_file(struct lock_request *req) {
 		usleep(1000+100);
 	}
 
-	if (time == req->timeout) {
-		printf("Timed out\n");
+	if (time == req->timeout) {
+		printf("Timed out\n");
+		return 1;
+	}
+	else {
+		return 0;
+	}
+}
+
+/*
+ * Check that a PID still belongs to a flock process started for the
+ * given lock, rather than an unrelated process that was given the PID
+ * after ours exited
+ */
+int flock_process(int pid, const char *filename) {
+	char    path[64],
+	        cmdline[4096];
+	ssize_t len;
+	int     fd,
+	        i;
+
+	if (!flock_binary(pid))
+		return 0;
+
+	snprintf(path, sizeof(path), "/proc/%i/cmdline", pid);
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return 0;
+	len = read(fd, cmdline, sizeof(cmdline) - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+	cmdline[len] = '\0';
+
+	for (i = 0; i < len; i += strlen(cmdline + i) + 1) {
+		if (strcmp(cmdline + i, filename) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Function to collect the result of an async lock request
+ * The ticket is the PID of the child process that was left
+ * acquiring the lock. It has succeeded once it holds the lock -
+ * its PID is in the lock file, or the kernel or backend names it -
+ * and failed if it exits before that.
+ */
+int await_ticket(struct lock_request *req, int ticket) {
+	struct owner_record rec;
+	int                 fd,
+	                    time = 0;
+
+	/*
+	 * Poll every 100ms, same granularity as unlock_file
+	 */
+	req->timeout = req->timeout * 10;
+	while (time++ < req->timeout || req->timeout == 0) {
+		errno = 0;
+		if (fileless(req)) {
+			if (holds_lock(req, ticket)) {
+				printf("Ticket %i has locked %s\n", ticket, req->filename);
+				return 0;
+			}
+		}
+		else if ((fd = open(req->filename, O_RDONLY)) >= 0) {
+			/*
+			 * Ranged locks leave the file alone, so ask the kernel
+			 */
+			if (req->n_ranges) {
+				if (range_holder(fd, req) == ticket) {
+					close(fd);
+					printf("Ticket %i has locked ranges of file %s\n", ticket, req->filename);
+					return 0;
+				}
+			}
+			else {
+				read_owner_record(fd, &rec);
+				if (rec.pid == ticket) {
+					close(fd);
+					printf("Ticket %i has locked file %s with fencing token %llu\n", ticket, req->filename, rec.token);
+					return 0;
+				}
+			}
+			close(fd);
+		}
+		else if (errno != ENOENT) {
+			printf("Failed to open file %s: %s\n", req->filename, strerror(errno));
+			return 1;
+		}
+
+		if (kill(ticket, 0) < 0) {
+			printf("Ticket %i failed to lock file %s\n", ticket, req->filename);
+			return 1;
+		}
+
+		usleep(100000);
+	}
+
+	/*
+	 * Timed out - tell the child to give up, as parent_loop would,
+	 * as long as the ticket is still the child we think it is
+	 */
+	if (!flock_process(ticket, req->filename)) {
+		printf("Ticket %i failed to lock file %s\n", ticket, req->filename);
+		return 1;
+	}
+	kill(ticket, PARENT_TO);
+	if ((req->stats = stats_lookup(req->filename)) != NULL)
+		stats_add(&req->stats->timeouts, 1);
+	trace_record(TRACE_TIMEOUT, req->filename, ticket, now_ns());
+	printf("Timed out\n");
+	return 1;
+}
+
+/*
+ * Function to find the process holding a chain, which may since have
+ * advanced past the first stage
+ * Leaves req->filename at the stage it holds. Returns 0 and prints
+ * the reason if no stage is held.
+ */
+int chain_holder(struct lock_request *req) {
+	int fd,
+	    pid,
+	    i;
+
+	for (i = 0; i < req->chain_len; i++) {
+		req->filename = req->chain[i];
+		if (fileless(req))
+			pid = fileless_holder(req);
+		else if (req->type == DOTLOCK)
+			pid = dotlock_holder(req);
+		else if ((fd = open(req->filename, O_RDONLY)) >= 0) {
+			pid = read_pid(fd);
+			close(fd);
+		} else
+			pid = 0;
+
+		if (pid > 0 && holds_lock(req, pid))
+			return pid;
+	}
+	req->filename = req->chain[0];
+	printf("No stage of the chain starting at %s is held\n", req->filename);
+	return 0;
+}
+
+/*
+ * Function to ask the holder of a chain to move on from this file
+ * The holder tells us with CHILD_OK or CHILD_FAIL once it has the
+ * next lock, which parent_sig_handler turns into our exit status.
+ */
+int advance_file(struct lock_request *req) {
+	int pid,
+	    time = 0;
+
+	if (req->chain)
+		pid = chain_holder(req);
+	else if ((pid = read_holder(req)) != 0 && !holds_lock(req, pid)) {
+		printf("Process %i no longer holds %s\n", pid, req->filename);
+		return 1;
+	}
+	if (pid == 0)
+		return 1;
+
+	signal(CHILD_OK, sig_handler);
+	signal(CHILD_FAIL, sig_handler);
+
+	errno = 0;
+	if (kill(pid, ADVANCE) < 0) {
+		printf("Failed to send signal to child process %i: %s\n", pid, strerror(errno));
+		return 1;
+	}
+
+	/*
+	 * Unlike parent_loop, don't kill the holder on timeout -
+	 * it still holds the current stage
+	 */
+	while (req->timeout == 0 || time++ < req->timeout) {
+		sleep(1);
+	}
+	printf("Timed out\n");
+	return 1;
+}
+
+/*
+ * Function to renew the lease held on a file
+ */
+int renew_file(struct lock_request *req) {
+	int pid;
+
+	if (req->chain)
+		pid = chain_holder(req);
+	else if ((pid = read_holder(req)) != 0 && !holds_lock(req, pid)) {
+		printf("Process %i no longer holds %s\n", pid, req->filename);
+		return 1;
+	}
+	if (pid == 0)
+		return 1;
+
+	errno = 0;
+	if (kill(pid, RENEW) < 0) {
+		printf("Failed to send signal to child process %i: %s\n", pid, strerror(errno));
+		return 1;
+	}
+	printf("Renewed lease on %s\n", req->filename);
+	return 0;
+}
+
+volatile sig_atomic_t alarm_fired = 0;
+
+void alarm_sig_handler(int sig) {
+	/*
+	 * Mostly here to interrupt a blocking lock call
+	 */
+	alarm_fired = 1;
+}
+
+/*
+ * Function to wait until a file is not locked, without keeping it locked
+ * Takes a shared lock and drops it straight away, so every waiter is let
+ * through together as soon as the exclusive holder lets go, instead of
+ * each one taking and releasing the lock in turn.
+ */
+int wait_free(struct lock_request *req) {
+	struct sigaction sa = {0};
+	struct flock     fl = {0};
+	useconds_t       delay = BACKOFF_MIN_US;
+	int              fd,
+	                 ret;
+
+	errno = 0;
+	if (fileless(req))
+		fd = -1;
+	else if ((fd = open(req->filename, O_RDONLY)) < 0) {
+		if (errno == ENOENT) {
+			printf("File %s is free\n", req->filename);
+			return 0;
+		}
+		printf("Failed to open file %s: %s\n", req->filename, strerror(errno));
+		return 1;
+	}
+
+	/*
+	 * No SA_RESTART so that the alarm interrupts the lock call
+	 */
+	sa.sa_handler = alarm_sig_handler;
+	sigaction(SIGALRM, &sa, NULL);
+	if (req->timeout > 0)
+		alarm(req->timeout);
+
+	printf("Waiting for file %s\n", req->filename);
+	errno = 0;
+	switch (req->type) {
+		case FLOCK:
+			ret = flock(fd, (req->no_block) ? LOCK_SH | LOCK_NB : LOCK_SH);
+			break;
+		case ABSTRACT:
+		case SYSV:
+		case DOTLOCK:
+		case TREE:
+			/*
+			 * No shared mode for a socket name, a semaphore, a
+			 * lock file or a tree - poll until nobody holds it
+			 */
+			while ((ret = (req->type == DOTLOCK) ? dotlock_holder(req) : fileless_holder(req)) > 0 &&
+			       !req->no_block && !alarm_fired) {
+				usleep(delay);
+				if ((delay *= 2) > BACKOFF_MAX_US)
+					delay = BACKOFF_MAX_US;
+			}
+			if (ret > 0)
+				errno = alarm_fired ? EINTR : EWOULDBLOCK;
+			ret = (ret == 0) ? 0 : -1;
+			break;
+		default:
+			fl.l_type   = F_RDLCK;
+			fl.l_whence = SEEK_SET;
+			ret = fcntl(fd, (req->no_block) ? F_SETLK : F_SETLKW, &fl);
+			break;
+	}
+	alarm(0);
+
+	/*
+	 * Closing the file drops the shared lock whichever type it was
+	 */
+	if (fd >= 0)
+		close(fd);
+
+	if (ret == -1) {
+		if (errno == EINTR)
+			printf("Timed out\n");
+		else if (errno == EWOULDBLOCK || errno == EAGAIN || errno == EACCES)
+			printf("File %s is locked\n", req->filename);
+		else
+			printf("Failed to wait for file %s: %s\n", req->filename, strerror(errno));
 		return 1;
 	}
+	printf("File %s is free\n", req->filename);
+	return 0;
+}
+
+/*
+ * Function to check whether anyone is waiting for a lock
+ * Uses the waiter count from the statistics table, falling back to
+ * blocked waiters in /proc/locks. Exits 0 if the lock is contended
+ * so that a script can write `if flock --contended file; then ...`
+ * Only looks the lock up, so asking about a lock that has never been
+ * taken doesn't use up a statistics slot.
+ */
+int check_contended(struct lock_request *req) {
+	struct lock_stats  *slot;
+	struct lock_target  target = {0};
+	int                 waiters;
+
+	if ((slot = stats_find(req->filename)) != NULL) {
+		waiters = stats_waiters(slot);
+	}
 	else {
-		return 0;
+		target.path = req->filename;
+		if (!scan_proc_locks(&target, 1))
+			return 2;
+		waiters = target.n_waiters;
+		free(target.locks);
+	}
+
+	printf("%i waiters\n", waiters);
+	return (waiters > 0) ? 0 : 1;
+}
+
+/*
+ * Function to print the fencing token of the last acquisition of a file
+ * Prints just the number so it can be captured by the caller
+ */
+int print_token(struct lock_request *req) {
+	struct owner_record rec;
+	int                 fd;
+
+	errno = 0;
+	if ((fd = open(req->filename, O_RDONLY)) < 0) {
+		printf("Failed to open file %s: %s\n", req->filename, strerror(errno));
+		return 1;
+	}
+	read_owner_record(fd, &rec);
+	close(fd);
+
+	printf("%llu\n", rec.token);
+	return 0;
+}
+
+/*
+ * Function to parse a signal given by name (TERM, SIGKILL) or number
+ * Returns 0 if the signal is not recognised
+ */
+int parse_signal(const char *arg) {
+	static const struct {
+		const char *name;
+		int         sig;
+	} signals[] = {
+		{"HUP",  SIGHUP},
+		{"INT",  SIGINT},
+		{"QUIT", SIGQUIT},
+		{"KILL", SIGKILL},
+		{"USR1", SIGUSR1},
+		{"USR2", SIGUSR2},
+		{"ALRM", SIGALRM},
+		{"TERM", SIGTERM},
+	};
+	char *end;
+	int   i,
+	      sig;
+
+	sig = (int)strtol(arg, &end, 10);
+	if (*end == '\0')
+		return (sig > 0 && sig < NSIG) ? sig : 0;
+
+	if (strncasecmp(arg, "SIG", 3) == 0)
+		arg += 3;
+	for (i = 0; i < (int)(sizeof(signals) / sizeof(signals[0])); i++) {
+		if (strcasecmp(arg, signals[i].name) == 0)
+			return signals[i].sig;
 	}
+	return 0;
 }
 
 int lock_file(struct lock_request *req) {
@@ -293,28 +4636,122 @@ int lock_file(struct lock_request *req) {
 }
 
 int main(int argc, char **argv) {
-	char                opt,
-	                   *end;
-	int                 longopt_idx,
+	char               *end,
+	                   *trace_dir = NULL,
+	                   *ns_dir    = NULL,
+	                   *ns_key    = NULL,
+	                   *gc_root   = NULL,
+	                    ns_path[PATH_MAX];
+	const char         *fs_name;
+	int                 opt,
+	                    longopt_idx,
+	                    auto_backend = 0,
+	                    mode    = 0,
+	                    verbose = 0,
 	                    unlock  = 0,
+	                    advance = 0,
+	                    renew   = 0,
+	                    token   = 0,
+	                    stats   = 0,
+	                    top     = 0,
+	                    who     = 0,
+	                    test    = 0,
+	                    waitfree = 0,
+	                    contended = 0,
+	                    ticket  = 0,
 	                    do_fork = 1;
 	pid_t               pid,
 	                    ppid,
 	                    cpid;
+	sigset_t            mask,
+	                    old_mask;
+	long                gc_rate = 0;
+	double              deadline;
+	uint64_t            now;
 	struct lock_request req     = {0};
+	struct lock_range  *ranges;
 	
 	/*
 	 * Get command line args
 	 */
+	enum {
+		OPT_ASYNC = 256,
+		OPT_AWAIT,
+		OPT_CHAIN,
+		OPT_ADVANCE,
+		OPT_TTL,
+		OPT_RENEW,
+		OPT_HEARTBEAT,
+		OPT_EXPIRE_SIGNAL,
+		OPT_TOKEN,
+		OPT_STATS,
+		OPT_TOP,
+		OPT_TRACE_EXPORT,
+		OPT_WHO,
+		OPT_TEST,
+		OPT_WAIT_FREE,
+		OPT_CONTENDED,
+		OPT_CONTENTION_FD,
+		OPT_DEADLINE,
+		OPT_MAX_WAITERS,
+		OPT_COUNT,
+		OPT_STALE,
+		OPT_LINK,
+		OPT_NAMESPACE,
+		OPT_KEY,
+		OPT_GC,
+		OPT_GC_RATE,
+		OPT_TREE,
+		OPT_MODE,
+		OPT_RANGE,
+		OPT_ESCALATE,
+		OPT_CALLSITE
+	};
 	static struct option long_options[] = {
 		{"timeout",  required_argument, 0, 't'},
 		{"no-block", no_argument,       0, 'n'},
 		{"unlock",   no_argument,       0, 'u'},
 		{"type",     required_argument, 0, 'T'},
+		{"verbose",  no_argument,       0, 'v'},
+		{"async",    no_argument,       0, OPT_ASYNC},
+		{"await",    required_argument, 0, OPT_AWAIT},
+		{"chain",    no_argument,       0, OPT_CHAIN},
+		{"advance",  no_argument,       0, OPT_ADVANCE},
+		{"ttl",      required_argument, 0, OPT_TTL},
+		{"renew",    no_argument,       0, OPT_RENEW},
+		{"heartbeat", required_argument, 0, OPT_HEARTBEAT},
+		{"expire-signal", required_argument, 0, OPT_EXPIRE_SIGNAL},
+		{"token",    no_argument,       0, OPT_TOKEN},
+		{"stats",    no_argument,       0, OPT_STATS},
+		{"top",      no_argument,       0, OPT_TOP},
+		{"trace-export", required_argument, 0, OPT_TRACE_EXPORT},
+		{"who",      no_argument,       0, OPT_WHO},
+		{"status",   no_argument,       0, OPT_WHO},
+		{"test",     no_argument,       0, OPT_TEST},
+		{"wait-free", no_argument,      0, OPT_WAIT_FREE},
+		{"contended", no_argument,      0, OPT_CONTENDED},
+		{"contention-fd", required_argument, 0, OPT_CONTENTION_FD},
+		{"deadline", required_argument, 0, OPT_DEADLINE},
+		{"max-waiters", required_argument, 0, OPT_MAX_WAITERS},
+		{"count",    required_argument, 0, OPT_COUNT},
+		{"stale",    required_argument, 0, OPT_STALE},
+		{"link",     no_argument,       0, OPT_LINK},
+		{"namespace", required_argument, 0, OPT_NAMESPACE},
+		{"key",      required_argument, 0, OPT_KEY},
+		{"gc",       required_argument, 0, OPT_GC},
+		{"gc-rate",  required_argument, 0, OPT_GC_RATE},
+		{"tree",     required_argument, 0, OPT_TREE},
+		{"mode",     required_argument, 0, OPT_MODE},
+		{"range",    required_argument, 0, OPT_RANGE},
+		{"escalate", required_argument, 0, OPT_ESCALATE},
+		{"callsite", required_argument, 0, OPT_CALLSITE},
 		{0, 0, 0, 0}
 	};
 	
-	while ((opt = getopt_long(argc, argv, "t:T:nu", long_options, &longopt_idx)) != -1) {
+	req.timeout = -1;
+	active_req  = &req;
+	
+	while ((opt = getopt_long(argc, argv, "t:T:nuv", long_options, &longopt_idx)) != -1) {
 		switch (opt) {
 			case 't':
 				req.timeout = (int)strtol(optarg, &end, 10);
@@ -332,19 +4769,235 @@ int main(int argc, char **argv) {
 				unlock = 1;
 				break;
 			
+			case 'v':
+				verbose = 1;
+				break;
+			
 			case 'T':
+				auto_backend = 0;
 				if (strcasecmp(optarg, "lockf") == 0)
 					req.type = LOCKF;
 				else if (strcasecmp(optarg, "flock") == 0)
 					req.type = FLOCK;
 				else if (strcasecmp(optarg, "fcntl") == 0)
 					req.type = FCNTL;
+				else if (strcasecmp(optarg, "abstract") == 0)
+					req.type = ABSTRACT;
+				else if (strcasecmp(optarg, "sysv") == 0)
+					req.type = SYSV;
+				else if (strcasecmp(optarg, "dotlock") == 0)
+					req.type = DOTLOCK;
+				else if (strcasecmp(optarg, "auto") == 0)
+					auto_backend = 1;
 				else {
 					printf("Invalid type: %s\n", optarg);
 					return 1;
 				}
 				break;
 			
+			case OPT_ASYNC:
+				req.async = 1;
+				break;
+			
+			case OPT_AWAIT:
+				ticket = (int)strtol(optarg, &end, 10);
+				if (*end != '\0' || ticket <= 0) {
+					printf("Ticket should be a positive integer\n");
+					return 1;
+				}
+				break;
+			
+			case OPT_CHAIN:
+				req.chain = argv;
+				break;
+			
+			case OPT_ADVANCE:
+				advance = 1;
+				break;
+			
+			case OPT_TTL:
+				req.ttl = (int)strtol(optarg, &end, 10);
+				if (*end != '\0' || req.ttl <= 0) {
+					printf("TTL argument should be a positive integer\n");
+					return 1;
+				}
+				break;
+			
+			case OPT_RENEW:
+				renew = 1;
+				break;
+			
+			case OPT_TOKEN:
+				token = 1;
+				break;
+			
+			case OPT_STATS:
+				stats = 1;
+				break;
+			
+			case OPT_TOP:
+				top = 1;
+				break;
+			
+			case OPT_TRACE_EXPORT:
+				trace_dir = optarg;
+				break;
+			
+			case OPT_WHO:
+				who = 1;
+				break;
+			
+			case OPT_TEST:
+				test = 1;
+				break;
+			
+			case OPT_WAIT_FREE:
+				waitfree = 1;
+				break;
+			
+			case OPT_CONTENDED:
+				contended = 1;
+				break;
+			
+			case OPT_DEADLINE:
+				/*
+				 * Seconds since the epoch, or +seconds from now
+				 */
+				deadline = strtod(optarg, &end);
+				if (*end != '\0' || deadline <= 0) {
+					printf("Deadline should be a time in seconds since the epoch, or +seconds\n");
+					return 1;
+				}
+				if (optarg[0] == '+')
+					deadline += realtime_ns() / 1e9;
+				req.deadline_ns = (uint64_t)(deadline * 1e9);
+				break;
+			
+			case OPT_MAX_WAITERS:
+				req.max_waiters = (int)strtol(optarg, &end, 10);
+				if (*end != '\0' || req.max_waiters <= 0) {
+					printf("Max waiters argument should be a positive integer\n");
+					return 1;
+				}
+				break;
+			
+			case OPT_COUNT:
+				req.count = (int)strtol(optarg, &end, 10);
+				if (*end != '\0' || req.count <= 0 || req.count > SYSV_MAX_COUNT) {
+					printf("Count argument should be a positive integer up to %i\n", SYSV_MAX_COUNT);
+					return 1;
+				}
+				break;
+			
+			case OPT_STALE:
+				req.stale = (int)strtol(optarg, &end, 10);
+				if (*end != '\0' || req.stale <= 0) {
+					printf("Stale argument should be a positive integer\n");
+					return 1;
+				}
+				break;
+			
+			case OPT_LINK:
+				req.dotlock_link = 1;
+				break;
+			
+			case OPT_NAMESPACE:
+				ns_dir = optarg;
+				break;
+			
+			case OPT_KEY:
+				if (*optarg == '\0') {
+					printf("Key should not be empty\n");
+					return 1;
+				}
+				ns_key = optarg;
+				break;
+			
+			case OPT_GC:
+				gc_root = optarg;
+				break;
+			
+			case OPT_GC_RATE:
+				gc_rate = strtol(optarg, &end, 10);
+				if (*end != '\0' || gc_rate <= 0) {
+					printf("GC rate should be a positive number of files per second\n");
+					return 1;
+				}
+				break;
+			
+			case OPT_TREE:
+				req.tree_dir = optarg;
+				break;
+			
+			case OPT_MODE:
+				if (!parse_tree_mode(optarg, &req.mode)) {
+					printf("Invalid mode: %s\n", optarg);
+					return 1;
+				}
+				mode = 1;
+				break;
+			
+			case OPT_RANGE:
+				/*
+				 * START:LEN, or START: to run to the end of the file
+				 */
+				if ((ranges = realloc(req.ranges, (req.n_ranges + 1) * sizeof(*req.ranges))) == NULL) {
+					printf("Failed to store range: %s\n", strerror(errno));
+					return 1;
+				}
+				req.ranges = ranges;
+				req.ranges[req.n_ranges].start = strtoll(optarg, &end, 10);
+				if (*end != ':' || req.ranges[req.n_ranges].start < 0) {
+					printf("Range should be START:LEN or START:\n");
+					return 1;
+				}
+				req.ranges[req.n_ranges].len = end[1] ? strtoll(end + 1, &end, 10) : 0;
+				if (*end != '\0' && !(*end == ':' && end[1] == '\0')) {
+					printf("Range should be START:LEN or START:\n");
+					return 1;
+				}
+				if (req.ranges[req.n_ranges].len < 0) {
+					printf("Range length should not be negative\n");
+					return 1;
+				}
+				req.n_ranges++;
+				break;
+			
+			case OPT_ESCALATE:
+				req.escalate = (int)strtol(optarg, &end, 10);
+				if (*end != '\0' || req.escalate <= 0) {
+					printf("Escalate argument should be a positive integer\n");
+					return 1;
+				}
+				break;
+			
+			case OPT_CALLSITE:
+				req.callsite = optarg;
+				break;
+			
+			case OPT_CONTENTION_FD:
+				req.contention_fd = (int)strtol(optarg, &end, 10);
+				if (*end != '\0' || req.contention_fd <= 0) {
+					printf("Contention argument should be a file descriptor\n");
+					return 1;
+				}
+				break;
+			
+			case OPT_HEARTBEAT:
+				req.heartbeat_fd = (int)strtol(optarg, &end, 10);
+				if (*end != '\0' || req.heartbeat_fd <= 0) {
+					printf("Heartbeat argument should be a file descriptor\n");
+					return 1;
+				}
+				break;
+			
+			case OPT_EXPIRE_SIGNAL:
+				if ((req.expire_sig = parse_signal(optarg)) == 0) {
+					printf("Invalid signal: %s\n", optarg);
+					return 1;
+				}
+				break;
+			
 			default:
 				printf("Unrecognised option: %c\n", opt);
 				return 1;
@@ -366,9 +5019,53 @@ int main(int argc, char **argv) {
 		req.timeout = 0;
 	
 	/*
-	 * Now get filename argument
+	 * Dumping statistics doesn't need a filename
+	 */
+	if (stats)
+		return print_stats();
+	if (top)
+		return print_top();
+	if (trace_dir)
+		return export_trace(trace_dir);
+	if (gc_root)
+		return gc_locks(gc_root, gc_rate);
+	
+	/*
+	 * Testing takes any number of filenames, or reads them from stdin
+	 */
+	if (test)
+		return test_files(&req, auto_backend, &argv[optind], argc - optind);
+	
+	/*
+	 * Querying holders takes any number of filenames
+	 */
+	if (who) {
+		if (optind >= argc) {
+			printf("No filename given\n");
+			return 1;
+		}
+		return print_who(&req, auto_backend, &argv[optind], argc - optind);
+	}
+	
+	/*
+	 * Now get filename argument, or work it out from the key
 	 */
-	if (optind < argc) {
+	if (ns_dir || ns_key) {
+		if (!ns_dir || !ns_key) {
+			printf("Namespace and key must be given together\n");
+			return 1;
+		}
+		if (optind < argc || req.chain) {
+			printf("Cannot give a filename or chain with a key\n");
+			return 1;
+		}
+		namespace_path(ns_dir, ns_key, ns_path);
+		req.filename = ns_path;
+		req.sharded  = 1;
+		if (verbose)
+			printf("Key %s is file %s\n", ns_key, ns_path);
+	}
+	else if (optind < argc) {
 		/*
 		 * Work out if we have a filename or a file descriptor
 		 */
@@ -378,6 +5075,19 @@ int main(int argc, char **argv) {
 			req.fd = 0;
 			req.filename = argv[optind];
 		}
+		
+		/*
+		 * A chain takes all of the remaining arguments as lock files,
+		 * in the order they will be locked
+		 */
+		if (req.chain) {
+			if (req.fd) {
+				printf("Cannot chain file descriptors\n");
+				return 1;
+			}
+			req.chain     = &argv[optind];
+			req.chain_len = argc - optind;
+		}
 	}
 	else {
 		printf("No filename given\n");
@@ -388,6 +5098,105 @@ int main(int argc, char **argv) {
 	 * End: command line args
 	 */
 	
+	/*
+	 * A tree lock is always exclusive unless told otherwise
+	 */
+	if (req.tree_dir) {
+		if (req.fd || req.chain) {
+			printf("Cannot tree lock a file descriptor or chain\n");
+			return 1;
+		}
+		req.type = TREE;
+		if (!mode)
+			req.mode = TREE_X;
+	}
+	else if (mode) {
+		printf("Mode needs a tree\n");
+		return 1;
+	}
+	
+	/*
+	 * Pick a backend to suit the filesystem if asked to
+	 */
+	else if (auto_backend) {
+		req.type = auto_type(&req, &fs_name);
+		if (verbose)
+			printf("Using %s locks for %s on %s\n", type_names[req.type], req.filename ? req.filename : argv[optind], fs_name);
+	}
+	else if (verbose)
+		printf("Using %s locks\n", type_names[req.type]);
+	
+	/*
+	 * Collect an async lock request if required
+	 */
+	if (ticket) {
+		if (req.fd) {
+			printf("Cannot await a file descriptor\n");
+			return 1;
+		}
+		return await_ticket(&req, ticket);
+	}
+	
+	/*
+	 * Move a chain holder on to its next file if required
+	 */
+	if (advance) {
+		if (req.fd) {
+			printf("Cannot advance a file descriptor\n");
+			return 1;
+		}
+		return advance_file(&req);
+	}
+	
+	/*
+	 * Report the fencing token if required
+	 */
+	if (token) {
+		if (req.fd) {
+			printf("Cannot read a token from a file descriptor\n");
+			return 1;
+		}
+		return print_token(&req);
+	}
+	
+	/*
+	 * Wait for the file to be free if required
+	 */
+	if (waitfree) {
+		if (req.fd) {
+			printf("Cannot wait on a file descriptor\n");
+			return 1;
+		}
+		return wait_free(&req);
+	}
+	
+	/*
+	 * Check for waiters if required
+	 */
+	if (contended) {
+		if (req.fd) {
+			printf("Cannot check a file descriptor for waiters\n");
+			return 1;
+		}
+		return check_contended(&req);
+	}
+	
+	/*
+	 * Renew a lease if required
+	 */
+	if (renew) {
+		if (req.fd) {
+			printf("Cannot renew a file descriptor\n");
+			return 1;
+		}
+		return renew_file(&req);
+	}
+	
+	if ((req.heartbeat_fd || (req.expire_sig && req.type != DOTLOCK)) && !req.ttl) {
+		printf("Heartbeat and expire signal need a TTL\n");
+		return 1;
+	}
+	
 	/*
 	 * Handle the unlock if required
 	 */
@@ -406,6 +5215,73 @@ int main(int argc, char **argv) {
 	if (req.fd && req.type == FLOCK)
 		do_fork = 0;
 	
+	if (req.count && req.type != SYSV) {
+		printf("Count is only supported by the sysv lock type\n");
+		return 1;
+	}
+	
+	if ((req.stale || req.dotlock_link) && req.type != DOTLOCK) {
+		printf("Stale and link are only supported by the dotlock lock type\n");
+		return 1;
+	}
+	
+	if ((req.n_ranges || req.escalate) && req.type != FCNTL) {
+		printf("Ranges are only supported by the fcntl lock type\n");
+		return 1;
+	}
+	if (!req.escalate)
+		req.escalate = RANGE_ESCALATE;
+	coalesce_ranges(&req);
+	
+	if (req.fd && req.type == DOTLOCK) {
+		printf("Cannot dotlock a file descriptor\n");
+		return 1;
+	}
+	
+	if (req.fd && req.type == ABSTRACT) {
+		printf("Cannot take an abstract lock on a file descriptor\n");
+		return 1;
+	}
+	
+	if (req.fd && req.type == SYSV) {
+		printf("Cannot take a semaphore lock on a file descriptor\n");
+		return 1;
+	}
+	
+	if (req.ttl && !do_fork) {
+		printf("Cannot set a TTL on a file descriptor lock\n");
+		return 1;
+	}
+	
+	if (req.async && !do_fork) {
+		printf("Cannot lock a file descriptor asynchronously\n");
+		return 1;
+	}
+	
+	/*
+	 * A deadline that has already passed can't be met, so don't queue.
+	 * Otherwise give up waiting when it passes, sooner than any timeout.
+	 */
+	if (req.deadline_ns) {
+		if (!do_fork) {
+			printf("Cannot set a deadline on a file descriptor lock\n");
+			return 1;
+		}
+		now = realtime_ns();
+		if (now >= req.deadline_ns) {
+			printf("Deadline has already passed\n");
+			return EXIT_REJECTED;
+		}
+		if (req.timeout == 0 || (uint64_t)req.timeout > (req.deadline_ns - now) / 1000000000 + 1)
+			req.timeout = (req.deadline_ns - now) / 1000000000 + 1;
+	}
+	
+	/*
+	 * Turn the request away now if the lock is too busy to serve it
+	 */
+	if (do_fork && !admit_request(&req))
+		return EXIT_REJECTED;
+	
 	if (do_fork) {
 		/*
 		 * When the child locks the file, it sends us a USR1 signal to let us know.
@@ -425,20 +5301,63 @@ int main(int argc, char **argv) {
 		 */
 		pid  = getpid();
 		ppid = getppid();
+		req.requested_ns = now_ns();
+		
+		/*
+		 * Check the lock order before we can block on it
+		 */
+		req.script_pid = ppid;
+		lockdep_check(&req);
+		
+		/*
+		 * Hold off the child's answer until the request has been traced
+		 */
+		sigemptyset(&mask);
+		sigaddset(&mask, CHILD_OK);
+		sigaddset(&mask, CHILD_FAIL);
+		sigprocmask(SIG_BLOCK, &mask, &old_mask);
+		fflush(stdout);
 		cpid = fork();
 		
 		if (cpid == 0) {
+			sigprocmask(SIG_SETMASK, &old_mask, NULL);
 			/*
 			 * Child process
+			 * In async mode, detach from the caller's stdout so
+			 * that the caller can capture the ticket with $(...)
+			 * without waiting for us to exit.
+			 */
+			if (req.async) {
+				int null_fd = open("/dev/null", O_RDWR);
+				if (null_fd >= 0) {
+					dup2(null_fd, STDOUT_FILENO);
+					dup2(null_fd, STDERR_FILENO);
+					close(null_fd);
+				}
+			}
+			/*
+			 * Exit rather than return from main(), so that req is
+			 * still there for child_exit() to release from atexit()
+			 */
+			exit(child_loop(&req, pid, ppid));
+		}
+		
+		trace_record(TRACE_REQUEST, req.filename, cpid, req.requested_ns);
+		sigprocmask(SIG_SETMASK, &old_mask, NULL);
+		if (req.async) {
+			/*
+			 * Don't wait for the child - hand back a ticket
+			 * that can be collected later with --await
 			 */
-			return child_loop(&req, pid, ppid);
+			printf("%i\n", cpid);
+			return 0;
 		}
 		else {
 			/*
 			 * Parent process just needs to hang around until
 			 * the child has done its locking
 			 */
-			return parent_loop(cpid, req.timeout);
+			return parent_loop(&req, cpid);
 		}
 	}
 	else {
@@ -446,6 +5365,7 @@ int main(int argc, char **argv) {
 		 * Lock file descriptor
 		 */
 		printf("Locking file descriptor %i\n", req.fd);
+		req.requested_ns = now_ns();
 		if (!lock_descriptor(&req)) {
 			return 1;
 		}
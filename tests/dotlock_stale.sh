@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# Race stale dotlock breakers against each other
+#
+# Each round leaves FILE.lock behind from a dead process, then starts
+# several non-blocking dotlock requests at once. Every one of them sees
+# the stale lock and tries to break it, but exactly one may end up
+# holding the lock.
+#
+# Usage: tests/dotlock_stale.sh [FLOCK] [ROUNDS] [BREAKERS]
+#
+
+FLOCK=${1:-./flock}
+ROUNDS=${2:-50}
+BREAKERS=${3:-2}
+
+DIR=$(mktemp -d) || exit 1
+FILE=$DIR/file
+trap 'rm -rf "$DIR"' EXIT
+
+failed=0
+round=1
+while [ $round -le $ROUNDS ]; do
+	sh -c 'exit 0' &
+	dead=$!
+	wait $dead
+	printf '%i\nhost=%s\ncreated=%i\n' $dead "$(hostname)" "$(date +%s)" > "$FILE.lock"
+
+	i=1
+	while [ $i -le $BREAKERS ]; do
+		"$FLOCK" -T dotlock -n "$FILE" > "$DIR/out.$i" 2>&1 &
+		i=$((i + 1))
+	done
+	wait
+
+	held=$(grep -l "^Child has successfully locked" "$DIR"/out.* | wc -l)
+	if [ "$held" -ne 1 ]; then
+		echo "Round $round: $held of $BREAKERS breakers hold the lock"
+		cat "$DIR"/out.*
+		failed=1
+	fi
+
+	"$FLOCK" -T dotlock -u "$FILE" > /dev/null 2>&1
+	rm -f "$DIR"/out.* "$FILE.lock"
+	round=$((round + 1))
+done
+
+[ $failed -eq 0 ] && echo "$ROUNDS rounds of $BREAKERS breakers: ok"
+exit $failed
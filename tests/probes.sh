@@ -0,0 +1,33 @@
+#!/bin/sh
+#
+# Check the USDT probes built into flock
+#
+# Every probe must be present and guarded by a semaphore, so that its
+# arguments are only worked out while a tracer is attached. Skipped if
+# flock was built without sys/sdt.h.
+#
+# Usage: tests/probes.sh [FLOCK]
+#
+
+FLOCK=${1:-./flock}
+PROBES="lock__request lock__acquired lock__failed holder__exit timeout request__done unlock__requested"
+
+NOTES=$(readelf -n "$FLOCK" 2>/dev/null | grep -A4 stapsdt) || {
+	echo "No probes in $FLOCK (built without sys/sdt.h): skipped"
+	exit 0
+}
+
+failed=0
+for probe in $PROBES; do
+	note=$(echo "$NOTES" | grep -A2 "Name: $probe\$")
+	if [ -z "$note" ]; then
+		echo "Probe $probe is missing"
+		failed=1
+	elif echo "$note" | grep -q "Semaphore: 0x0*\$"; then
+		echo "Probe $probe has no semaphore"
+		failed=1
+	fi
+done
+
+[ $failed -eq 0 ] && echo "All probes present with semaphores: ok"
+exit $failed